@@ -4,47 +4,233 @@
 #include "stdio.h"
 #include "assert.h"
 
-/* Returns the index of the least significant bit that is set in byte.
-   If byte == 0, the behaviour is undefined. */
-static int lsb_set(uint8_t byte) {
-  int i = 0;
-  /* FIXME: Surely something in Hacker's delight could speed this up? */
-  while ((byte & 1) == 0) {
-    ++i;
-    byte >>= 1;
+/* Returns the index of the least significant bit that is set in word.
+   If word == 0, the behaviour is undefined. This compiles to a single 'bsf'. */
+static inline unsigned lsb_set(uint32_t word) {
+  return __builtin_ctz(word);
+}
+
+/* Fill in the number of words at each level for a bitmap of max_extent,
+   returning the number of summary levels. */
+static unsigned calc_levels(int64_t max_extent, uint32_t *nwords) {
+  uint64_t n = ((uint64_t)max_extent + 1 + 31) >> 5;
+  unsigned l = 0;
+
+  nwords[0] = n;
+  while (n > 1) {
+    n = (n + 31) >> 5;
+    assert(l < BITMAP_MAX_LEVELS && "Bitmap too large!");
+    nwords[++l] = n;
+  }
+  return l;
+}
+
+/* Set the first 'nbits' bits of a summary level. */
+static void fill_level(uint32_t *lvl, uint64_t nbits) {
+  for (uint64_t i = 0; i < (nbits >> 5); ++i)
+    lvl[i] = ~0U;
+  if (nbits & 31)
+    lvl[nbits >> 5] = (1U << (nbits & 31)) - 1;
+}
+
+/* Mark word 'w' of the level below summary 's' as nonzero, propagating up
+   until we meet a summary word that was already nonzero. */
+static void summary_mark(uint32_t **s, unsigned nlevels, uint64_t w) {
+  for (unsigned l = 0; l < nlevels; ++l) {
+    uint32_t old = s[l][w >> 5];
+    s[l][w >> 5] = old | (1U << (w & 31));
+    if (old != 0)
+      break;
+    w >>= 5;
+  }
+}
+
+/* Mark word 'w' of the level below summary 's' as zero, propagating up
+   until we leave a summary word that is still nonzero. */
+static void summary_unmark(uint32_t **s, unsigned nlevels, uint64_t w) {
+  for (unsigned l = 0; l < nlevels; ++l) {
+    uint32_t new = s[l][w >> 5] & ~(1U << (w & 31));
+    s[l][w >> 5] = new;
+    if (new != 0)
+      break;
+    w >>= 5;
   }
-  return i;
 }
 
-void bitmap_init(bitmap_t *xb, uint8_t *storage, int64_t max_extent) {
+/* Store 'new' into data word 'w', keeping both summaries up to date. */
+static void store_word(bitmap_t *xb, uint64_t w, uint32_t new) {
+  uint32_t old = xb->data[w];
+  xb->data[w] = new;
+
+  if (old == 0 && new != 0)
+    summary_mark(xb->set, xb->nlevels, w);
+  else if (old != 0 && new == 0)
+    summary_unmark(xb->set, xb->nlevels, w);
+
+  if ((xb->flags & BITMAP_TRACK_CLEAR) == 0)
+    return;
+
+  if (old == ~0U && new != ~0U)
+    summary_mark(xb->clr, xb->nlevels, w);
+  else if (old != ~0U && new == ~0U)
+    summary_unmark(xb->clr, xb->nlevels, w);
+}
+
+size_t bitmap_calc_overhead(int64_t max_extent, int flags) {
+  uint32_t nwords[BITMAP_MAX_LEVELS+1];
+  unsigned nlevels = calc_levels(max_extent, nwords);
+  unsigned nsummaries = (flags & BITMAP_TRACK_CLEAR) ? 2 : 1;
+
+  size_t accum = nwords[0];
+  for (unsigned l = 1; l <= nlevels; ++l)
+    accum += nsummaries * nwords[l];
+  return accum * sizeof(uint32_t);
+}
+
+void bitmap_init(bitmap_t *xb, uint8_t *storage, int64_t max_extent,
+                 int flags) {
   xb->max_extent = max_extent;
-  xb->data = storage;
+  xb->flags = flags;
+  xb->nlevels = calc_levels(max_extent, xb->nwords);
+
+  memset(storage, 0, bitmap_calc_overhead(max_extent, flags));
 
-  memset(xb->data, 0, max_extent / 8 + 1);
+  /* Summaries first, top level first, so searches walk forwards. */
+  uint32_t *p = (uint32_t*)storage;
+  for (unsigned l = xb->nlevels; l-- > 0; ) {
+    xb->set[l] = p;
+    p += xb->nwords[l+1];
+  }
+  if (flags & BITMAP_TRACK_CLEAR) {
+    for (unsigned l = xb->nlevels; l-- > 0; ) {
+      xb->clr[l] = p;
+      p += xb->nwords[l+1];
+      /* Every word starts empty, so every word is "not full". */
+      fill_level(xb->clr[l], xb->nwords[l]);
+    }
+  }
+  xb->data = p;
 }
 
 void bitmap_set(bitmap_t *xb, unsigned idx) {
-  xb->data[idx/8] |= (1 << (idx%8));
+  uint32_t word = xb->data[idx >> 5];
+  if ((word & (1U << (idx & 31))) == 0)
+    store_word(xb, idx >> 5, word | (1U << (idx & 31)));
   assert(bitmap_isset(xb, idx));
 }
 
 void bitmap_clear(bitmap_t *xb, unsigned idx) {
-  xb->data[idx/8] &= ~(1 << (idx%8));
+  uint32_t word = xb->data[idx >> 5];
+  if (word & (1U << (idx & 31)))
+    store_word(xb, idx >> 5, word & ~(1U << (idx & 31)));
+}
+
+/* Apply a set or clear to n bits starting at idx, one word at a time. */
+static void apply_range(bitmap_t *xb, unsigned idx, unsigned n, int set) {
+  while (n > 0) {
+    unsigned bit = idx & 31;
+    unsigned cnt = (32 - bit < n) ? 32 - bit : n;
+    uint32_t mask = (cnt == 32) ? ~0U : ((1U << cnt) - 1) << bit;
+
+    uint32_t word = xb->data[idx >> 5];
+    store_word(xb, idx >> 5, set ? (word | mask) : (word & ~mask));
+
+    idx += cnt;
+    n -= cnt;
+  }
+}
+
+void bitmap_set_range(bitmap_t *xb, unsigned idx, unsigned n) {
+  apply_range(xb, idx, n, 1);
+}
+
+void bitmap_clear_range(bitmap_t *xb, unsigned idx, unsigned n) {
+  apply_range(xb, idx, n, 0);
 }
 
 int bitmap_isset(bitmap_t *xb, unsigned idx) {
-  return (xb->data[idx/8] & (1 << (idx%8))) ? 1 : 0;
+  return (xb->data[idx >> 5] & (1U << (idx & 31))) ? 1 : 0;
 }
 int bitmap_isclear(bitmap_t *xb, unsigned idx) {
   return !bitmap_isset(xb, idx);
 }
 
-int64_t bitmap_first_set(bitmap_t *xb) {
-  for (uint64_t i = 0; i < (xb->max_extent >> 3) + 1ULL; i ++) {
-    if (xb->data[i] == 0) continue;
+/* Find the first clear bit at or after 'from' by scanning word by word, for
+   bitmaps without a clear summary. */
+static int64_t scan_clear(bitmap_t *xb, uint64_t from) {
+  if ((int64_t)from > xb->max_extent)
+    return -1;
+
+  uint64_t pos = from >> 5;
+  uint32_t word = ~xb->data[pos] & (~0U << (from & 31));
+  while (word == 0) {
+    if (++pos >= xb->nwords[0])
+      return -1;
+    word = ~xb->data[pos];
+  }
+
+  int64_t idx = (pos << 5) + lsb_set(word);
+  return (idx > xb->max_extent) ? -1 : idx;
+}
+
+/* Find the first index >= from whose bit is set (or clear, if want_clear).
+
+   We check the remainder of the word 'from' lies in, then climb the summary
+   levels looking for a later nonzero word, then descend back down with one
+   bsf per level. */
+static int64_t search(bitmap_t *xb, uint64_t from, int want_clear) {
+  uint32_t **s = want_clear ? xb->clr : xb->set;
+  uint32_t invert = want_clear ? ~0U : 0;
+
+  if (want_clear && (xb->flags & BITMAP_TRACK_CLEAR) == 0)
+    return scan_clear(xb, from);
+
+  if ((int64_t)from > xb->max_extent)
+    return -1;
 
-    int64_t idx = i * 8 + lsb_set(xb->data[i]);
-    return (idx > xb->max_extent) ? -1 : idx;
+  uint64_t pos = from >> 5;
+  uint32_t word = (xb->data[pos] ^ invert) & (~0U << (from & 31));
+
+  if (word == 0) {
+    /* Climb until a summary word has a bit at or after the next position. */
+    unsigned l;
+    ++pos;
+    for (l = 0; l < xb->nlevels; ++l) {
+      if ((pos >> 5) >= xb->nwords[l+1])
+        return -1;
+      uint32_t bits = s[l][pos >> 5] & (~0U << (pos & 31));
+      if (bits) {
+        pos = (pos & ~31ULL) + lsb_set(bits);
+        break;
+      }
+      pos = (pos >> 5) + 1;
+    }
+    if (l == xb->nlevels)
+      return -1;
+
+    /* 'pos' is now a nonzero word in level l-1; descend to the data. */
+    while (l-- > 0)
+      pos = (pos << 5) + lsb_set(s[l][pos]);
+
+    word = xb->data[pos] ^ invert;
   }
-  return -1;
+
+  int64_t idx = (pos << 5) + lsb_set(word);
+  return (idx > xb->max_extent) ? -1 : idx;
+}
+
+int64_t bitmap_first_set(bitmap_t *xb) {
+  return search(xb, 0, 0);
+}
+
+int64_t bitmap_first_clear(bitmap_t *xb) {
+  return search(xb, 0, 1);
+}
+
+int64_t bitmap_next_set(bitmap_t *xb, unsigned from) {
+  return search(xb, from, 0);
+}
+
+int64_t bitmap_next_clear(bitmap_t *xb, unsigned from) {
+  return search(xb, from, 1);
 }
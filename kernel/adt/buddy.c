@@ -19,7 +19,7 @@
      **Free**: *log(n)*
 
    **Space complexity**
-     The buddy allocator requires several bitmaps to operate - these are dependent upon the address space size it operates over, so it is similar in requirement to the bitmap allocator mentioned previously - *O(n)*.
+     The buddy allocator requires under a bit per tree node - about 1.6 bits per minimum-sized block in total - plus a small summary for each order. This is dependent upon the address space size it operates over, so it is similar in requirement to the bitmap allocator mentioned previously - *O(n)*.
 
    Implementation
    --------------
@@ -31,6 +31,7 @@
 #include "assert.h"
 #include "hal.h"
 #include "math.h"
+#include "string.h"
 #include "adt/buddy.h"
 
 /**
@@ -44,24 +45,233 @@
 #define INC_ORDER(x) (x << 1)
 #define DEC_ORDER(x) (x >> 1)
 
+/** }
 
+   A block and its buddy are never both free: as soon as the second of them is freed they coalesce into their parent. So below the top order, each pair of buddies is in one of three states - neither free, the first free, or the second free - which takes :math:`log_2(3)` bits rather than two. We pack the states of five pairs into each byte as base-3 digits (:math:`3^5 = 243`), which is 0.8 bits per node instead of one. The top order has no such rule, as its blocks are separate roots, so it keeps a plain bitmap.
+
+   Alongside them we keep a count of free blocks per order, and a mask with one bit per order that has any free blocks at all.
+
+   The blocks themselves can't hold an intrusive free list - the buddy allocator manages address space that is usually not mapped (physical memory, or virtual space in a vmspace). Instead the mask lets ``buddy_alloc()`` jump straight to the smallest order that can satisfy a request with a single ``bsf``. Each order's bitmap then has a bit set for every word of pair states with a free block in it, so its summary levels find such a word in *O(log:sub:`32`(n))* reads, and the word's four bytes are decoded to pop the block. That is not the *O(1)* pop of a free list, but it is only a handful of reads for any region we manage. { */
+
+#define PAIRS_PER_BYTE 5
+#define NODES_PER_BYTE (PAIRS_PER_BYTE * 2)
+#define NODES_PER_WORD (NODES_PER_BYTE * 4)
+
+static const uint8_t pow3[PAIRS_PER_BYTE] = {1, 3, 9, 27, 81};
+/* ceil(2^16 / pow3[k]), so that (b * inv_pow3[k]) >> 16 == b / pow3[k] for
+   any byte b without a divide. */
+static const uint32_t inv_pow3[PAIRS_PER_BYTE] = {65536, 21846, 7282, 2428, 810};
+
+/* Returns base-3 digit k of the byte b. */
+static unsigned digit(unsigned b, unsigned k) {
+  return ((b * inv_pow3[k]) >> 16) % 3;
+}
+
+static int is_top(buddy_t *bd, unsigned order_idx) {
+  return order_idx == bd->max_order - MIN_BUDDY_SZ_LOG2;
+}
+
+/* Returns the state of the pair holding node 'n' (counted from the order's
+   first node): 0 if neither is free, 1 if the first is and 2 if the
+   second is. */
+static unsigned pair_state(buddy_t *bd, unsigned order_idx, unsigned n) {
+  uint8_t *bytes = (uint8_t*)bd->pairs[order_idx];
+  unsigned pair = n >> 1;
+  return digit(bytes[pair / PAIRS_PER_BYTE], pair % PAIRS_PER_BYTE);
+}
+
+static void set_pair_state(buddy_t *bd, unsigned order_idx, unsigned n,
+                           unsigned state) {
+  uint8_t *bytes = (uint8_t*)bd->pairs[order_idx];
+  unsigned pair = n >> 1;
+  unsigned word = n / NODES_PER_WORD;
+  uint32_t was = bd->pairs[order_idx][word];
+
+  unsigned k = pair % PAIRS_PER_BYTE;
+  uint8_t *b = &bytes[pair / PAIRS_PER_BYTE];
+  *b = *b + ((int)state - (int)digit(*b, k)) * pow3[k];
+
+  /* Keep the bitmap in step with which words have a free block. */
+  uint32_t now = bd->pairs[order_idx][word];
+  if (was == 0 && now != 0)
+    bitmap_set(&bd->orders[order_idx], word);
+  else if (was != 0 && now == 0)
+    bitmap_clear(&bd->orders[order_idx], word);
+}
+
+/* Returns the first free node at or after node 'n' in the word of pair
+   states at 'bytes', or -1. */
+static int word_next_free(const uint8_t *bytes, unsigned n) {
+  for (unsigned i = n / NODES_PER_BYTE; i < 4; ++i) {
+    unsigned node = i * NODES_PER_BYTE;
+    for (unsigned v = bytes[i]; v != 0; v /= 3, node += 2)
+      if (v % 3 != 0 && node + v % 3 - 1 >= n)
+        return node + v % 3 - 1;
+  }
+  return -1;
+}
+
+static int is_free(buddy_t *bd, unsigned order_idx, unsigned idx) {
+  if (idx < bd->first[order_idx])
+    return 0;
+  unsigned n = idx - bd->first[order_idx];
+  if (is_top(bd, order_idx))
+    return bitmap_isset(&bd->orders[order_idx], n);
+  return pair_state(bd, order_idx, n) == 1 + (n & 1);
+}
+
+static void mark_free(buddy_t *bd, unsigned order_idx, unsigned idx) {
+  unsigned n = idx - bd->first[order_idx];
+  if (is_top(bd, order_idx)) {
+    assert(bitmap_isclear(&bd->orders[order_idx], n) && "Double free!");
+    bitmap_set(&bd->orders[order_idx], n);
+  } else {
+    assert(pair_state(bd, order_idx, n) == 0 && "Double free!");
+    set_pair_state(bd, order_idx, n, 1 + (n & 1));
+  }
+  if (bd->nfree[order_idx]++ == 0)
+    bd->free_orders |= 1U << order_idx;
+}
+
+static void mark_used(buddy_t *bd, unsigned order_idx, unsigned idx) {
+  unsigned n = idx - bd->first[order_idx];
+  if (is_top(bd, order_idx))
+    bitmap_clear(&bd->orders[order_idx], n);
+  else
+    set_pair_state(bd, order_idx, n, 0);
+  if (--bd->nfree[order_idx] == 0)
+    bd->free_orders &= ~(1U << order_idx);
+}
+
+/* Returns the first free block at or after 'from' in an order, or -1. */
+static int64_t next_free(buddy_t *bd, unsigned order_idx, uint64_t from) {
+  bitmap_t *bm = &bd->orders[order_idx];
+  uint32_t first = bd->first[order_idx];
+  if (from < first)
+    from = first;
+  uint64_t n = from - first;
+
+  if (is_top(bd, order_idx)) {
+    if (n > (uint64_t)bm->max_extent)
+      return -1;
+    int64_t i = bitmap_next_set(bm, n);
+    return (i == -1) ? -1 : i + first;
+  }
+
+  /* Try the rest of the word 'from' is in, then the next word with any
+     free block at all. */
+  uint64_t word = n / NODES_PER_WORD;
+  if (word > (uint64_t)bm->max_extent)
+    return -1;
+  int i = word_next_free((uint8_t*)&bd->pairs[order_idx][word],
+                         n % NODES_PER_WORD);
+  if (i == -1) {
+    if (word == (uint64_t)bm->max_extent)
+      return -1;
+    int64_t w = bitmap_next_set(bm, word + 1);
+    if (w == -1)
+      return -1;
+    word = w;
+    i = word_next_free((uint8_t*)&bd->pairs[order_idx][word], 0);
+    assert(i != -1 && "Buddy bitmap out of sync with pair states!");
+  }
+  return first + word * NODES_PER_WORD + i;
+}
+
+/** } */
+
+/**
+   The tree is rooted at ``base``, which is the region start rounded down to the size of the largest order that fits in the region. This makes every block naturally aligned in absolute terms, so a region that doesn't start on a large boundary (such as physical memory starting at 1MB) still hands out aligned blocks. A region larger than the largest order is simply a forest of top-order roots.
+
+   Node indices stay relative to ``base``, but blocks that end before the region starts can never be free, so each order only stores from the pair holding the block containing ``start`` onwards. A region like the kernel heap, which starts 256MB past its root, then doesn't pay for bits covering memory it can never hand out. { */
+
+/* Returns the largest order that can hold a block inside region 'r'. */
+static unsigned max_order_for(range_t r) {
+  if (r.extent < (1ULL << MIN_BUDDY_SZ_LOG2))
+    return MIN_BUDDY_SZ_LOG2;
+
+  unsigned l2 = 63 - __builtin_clzll(r.extent);
+  return (l2 > MAX_BUDDY_SZ_LOG2) ? MAX_BUDDY_SZ_LOG2 : l2;
+}
+
+static uint64_t base_for(range_t r, unsigned max_order) {
+  return r.start & ~((1ULL << max_order) - 1);
+}
+
+/* The first block of size 2^log_sz an order stores: the first of the pair
+   holding the block that contains the region start. */
+static uint64_t first_for(range_t r, uint64_t base, unsigned log_sz) {
+  return ((r.start - base) >> log_sz) & ~1ULL;
+}
+
+/* The number of blocks of size 2^log_sz an order stores, from first_for()
+   up to the end of the region. */
+static uint64_t blocks_for(range_t r, uint64_t base, unsigned log_sz) {
+  return ((r.start + r.extent - base) >> log_sz) - first_for(r, base, log_sz);
+}
+
+/* The number of words of pair states needed for 'n' blocks. */
+static uint64_t pair_words(uint64_t n) {
+  return (n + NODES_PER_WORD - 1) / NODES_PER_WORD;
+}
+
+/* The bytes of overhead for an order holding 'n' blocks. Below the top
+   order there is always at least one whole pair in the region, so n > 0. */
+static size_t order_overhead(uint64_t n, int top) {
+  if (top)
+    return bitmap_calc_overhead(n, /*flags=*/0);
+  return bitmap_calc_overhead(pair_words(n) - 1, /*flags=*/0) +
+    pair_words(n) * sizeof(uint32_t);
+}
+
+/* Is the block of size 2^log_sz at 'addr' entirely inside the region? */
+static int block_in_region(buddy_t *bd, uint64_t addr, unsigned log_sz) {
+  return addr >= bd->start &&
+    addr + (1ULL << log_sz) <= bd->start + bd->size;
+}
+
+/** } */
 
 size_t buddy_calc_overhead(range_t r) {
+  unsigned max_order = max_order_for(r);
+  uint64_t base = base_for(r, max_order);
+
   size_t accum = 0;
-  for (unsigned i = MIN_BUDDY_SZ_LOG2; i <= MAX_BUDDY_SZ_LOG2; ++i)
-    accum += (r.extent >> i) / 8 + 1;
+  for (unsigned i = MIN_BUDDY_SZ_LOG2; i <= max_order; ++i)
+    accum += order_overhead(blocks_for(r, base, i), i == max_order);
   return accum;
 }
 
+/**
+   All of the orders live in the one overhead array, laid out breadth-first: the top order first and the smallest order last, each order's bitmap followed by its pair states. The small, high orders that every split and coalesce walks through are then packed together at the start of the array and stay in cache, and only the lowest orders are spread out.
+
+   The allocator never searches for a clear bit, so the bitmaps are created without their clear-bit summary. { */
+
 int buddy_init(buddy_t *bd, uint8_t *overhead_storage,
                range_t r, int start_freed) {
   bd->start = r.start;
   bd->size  = r.extent;
-
-  for (unsigned i = 0; i < NUM_BUDDY_BUCKETS; ++i) {
-    unsigned idx = bd->size >> (MIN_BUDDY_SZ_LOG2 + i);
-    bitmap_init(&bd->orders[i], overhead_storage, idx);
-    overhead_storage += idx / 8 + 1;
+  bd->max_order = max_order_for(r);
+  bd->base  = base_for(r, bd->max_order);
+  bd->free_orders = 0;
+
+  for (unsigned i = bd->max_order - MIN_BUDDY_SZ_LOG2 + 1; i-- > 0; ) {
+    unsigned log_sz = MIN_BUDDY_SZ_LOG2 + i;
+    uint64_t n = blocks_for(r, bd->base, log_sz);
+    size_t sz = order_overhead(n, is_top(bd, i));
+    bd->first[i] = first_for(r, bd->base, log_sz);
+
+    if (is_top(bd, i)) {
+      bitmap_init(&bd->orders[i], overhead_storage, n, /*flags=*/0);
+      bd->pairs[i] = NULL;
+    } else {
+      bitmap_init(&bd->orders[i], overhead_storage, pair_words(n) - 1,
+                  /*flags=*/0);
+      bd->pairs[i] = (uint32_t*)(overhead_storage + sz) - pair_words(n);
+      memset(bd->pairs[i], 0, pair_words(n) * sizeof(uint32_t));
+    }
+    overhead_storage += sz;
+    bd->nfree[i] = 0;
   }
 
   if (start_freed != 0)
@@ -70,119 +280,253 @@ int buddy_init(buddy_t *bd, uint8_t *overhead_storage,
   return 0;
 }
 
-uint64_t buddy_alloc(buddy_t *bd, unsigned sz) {
+/** } */
 
-  unsigned log_sz = log2_roundup(sz);
-  if (log_sz > MAX_BUDDY_SZ_LOG2)
-    panic("buddy_alloc had request that was too large to handle!");
+/* Allocate the block of size 2^target that contains 'addr', out of the free
+   block 'idx' of size 2^log_sz, splitting as we go. Returns the address of
+   the allocated block. */
+static uint64_t carve(buddy_t *bd, unsigned log_sz, unsigned idx,
+                      unsigned target, uint64_t addr) {
+  /* Mark the block as not free. */
+  mark_used(bd, log_sz - MIN_BUDDY_SZ_LOG2, idx);
 
-  unsigned orig_log_sz = log_sz;
+  /* We may have to split blocks to get back to a block of the right size. */
+  for (; log_sz != target; --log_sz) {
+    /* Carry on down into whichever child holds 'addr'... */
+    idx = INC_ORDER(idx);
+    if (((addr - bd->base) >> (log_sz - 1)) & 1)
+      ++idx;
 
-  /* Search for a free block - we may have to increase the size of the
-     block to find a free one. */
-  int64_t idx;
-  while (log_sz <= MAX_BUDDY_SZ_LOG2) {
-    int order_idx = log_sz - MIN_BUDDY_SZ_LOG2;
-    
-    idx = bitmap_first_set(&bd->orders[order_idx]);
+    /* And set the other one free in the next order. */
+    mark_free(bd, log_sz - 1 - MIN_BUDDY_SZ_LOG2, BUDDY(idx));
+  }
 
-    if (idx != -1)
-      break;
+  return bd->base + ((uint64_t)idx << target);
+}
 
-    ++log_sz;
+/* Returns the order of the free block that contains the block of size
+   2^log_sz at 'addr' (which may be that block itself), or -1 if there is
+   none. */
+static int free_ancestor(buddy_t *bd, uint64_t addr, unsigned log_sz) {
+  for (; log_sz <= bd->max_order; ++log_sz) {
+    unsigned idx = (addr - bd->base) >> log_sz;
+    if (is_free(bd, log_sz - MIN_BUDDY_SZ_LOG2, idx))
+      return log_sz;
   }
+  return -1;
+}
+
+/* Clamp a requested size to a valid order, returning -1 if it can't ever be
+   satisfied. */
+static int order_for(buddy_t *bd, uint64_t sz) {
+  unsigned log_sz = log2_roundup64(sz);
+  if (log_sz > bd->max_order)
+    /* Larger than any block this region could ever hold. */
+    return -1;
+  if (log_sz < MIN_BUDDY_SZ_LOG2)
+    log_sz = MIN_BUDDY_SZ_LOG2;
+  return log_sz;
+}
+
+uint64_t buddy_alloc(buddy_t *bd, uint64_t sz) {
+  int log_sz = order_for(bd, sz);
+  if (log_sz == -1)
+    return ~0ULL;
 
-  if (idx == -1)
+  /* Find the smallest order at least as large as the request that has a
+     free block - we may have to increase the size of the block. */
+  uint32_t candidates = bd->free_orders >> (log_sz - MIN_BUDDY_SZ_LOG2);
+  if (candidates == 0)
     /* No free blocks :( */
     return ~0ULL;
 
-  /* We may have to split blocks to get back to a block of the minimum size. */
-  for (; log_sz != orig_log_sz; --log_sz) {
-    int order_idx = log_sz - MIN_BUDDY_SZ_LOG2;
+  unsigned found = log_sz + __builtin_ctz(candidates);
 
-    /* We're splitting a block, so deallocate it first... */
-    bitmap_clear(&bd->orders[order_idx], idx);
+  int64_t idx = next_free(bd, found - MIN_BUDDY_SZ_LOG2, 0);
+  assert(idx != -1 && "Buddy free count out of sync with bitmap!");
 
-    /* Then set both its children as free in the next order. */
-    idx = INC_ORDER(idx);
-    bitmap_set(&bd->orders[order_idx-1], idx);
-    bitmap_set(&bd->orders[order_idx-1], idx+1);
+  return carve(bd, found, idx, log_sz, bd->base + ((uint64_t)idx << found));
+}
+
+size_t buddy_alloc_batch(buddy_t *bd, uint64_t sz, size_t n, uint64_t *out) {
+  size_t i;
+  for (i = 0; i < n; ++i) {
+    out[i] = buddy_alloc(bd, sz);
+    if (out[i] == ~0ULL)
+      break;
   }
+  return i;
+}
 
-  /* Mark the block as not free. */
-  int order_idx = log_sz - MIN_BUDDY_SZ_LOG2;
-  bitmap_clear(&bd->orders[order_idx], idx);
+uint64_t buddy_alloc_aligned(buddy_t *bd, uint64_t sz, uint64_t align) {
+  int log_sz = order_for(bd, sz);
+  if (log_sz == -1)
+    return ~0ULL;
+
+  unsigned log_align = log2_roundup64(align);
+  if (log_align <= (unsigned)log_sz)
+    /* Every block is naturally aligned, so this is a normal allocation. */
+    return buddy_alloc(bd, sz);
+
+  /* Blocks smaller than the alignment are only usable if they happen to
+     start on an aligned address. Prefer those, smallest first, so we don't
+     break up a large block when a suitable small one exists. Aligned
+     blocks at order k are every 'stride'th index, starting at 'first'. */
+  for (unsigned k = log_sz; k < log_align && k <= bd->max_order; ++k) {
+    unsigned order_idx = k - MIN_BUDDY_SZ_LOG2;
+    if (bd->nfree[order_idx] == 0)
+      continue;
+
+    uint64_t stride = 1ULL << (log_align - k);
+    uint64_t first = (stride - ((bd->base >> k) & (stride - 1))) & (stride - 1);
+
+    int64_t idx = next_free(bd, order_idx, first);
+    while (idx != -1) {
+      uint64_t rem = ((uint64_t)idx - first) & (stride - 1);
+      if (rem == 0)
+        return carve(bd, k, idx, log_sz, bd->base + ((uint64_t)idx << k));
+
+      idx = next_free(bd, order_idx, idx + stride - rem);
+    }
+  }
 
-  uint64_t addr = bd->start + ((uint64_t)idx << log_sz);
-  return addr;  
+  /* Otherwise any block at least as large as the alignment will do, as
+     long as the tree's base is itself aligned. */
+  if (log_align > bd->max_order || bd->base & ((1ULL << log_align) - 1))
+    return ~0ULL;
+
+  uint32_t candidates = bd->free_orders >> (log_align - MIN_BUDDY_SZ_LOG2);
+  if (candidates == 0)
+    return ~0ULL;
+
+  unsigned found = log_align + __builtin_ctz(candidates);
+  int64_t idx = next_free(bd, found - MIN_BUDDY_SZ_LOG2, 0);
+  assert(idx != -1 && "Buddy free count out of sync with bitmap!");
+
+  return carve(bd, found, idx, log_sz, bd->base + ((uint64_t)idx << found));
 }
 
-static int aligned_for(uint64_t addr, uintptr_t lg2) {
-  uintptr_t mask = ~( ~0ULL << lg2 );
+/* Calls fn(bd, addr, log_sz) for each of the largest naturally aligned
+   blocks that exactly tile 'range', stopping early if fn returns nonzero. */
+static int for_each_block(buddy_t *bd, range_t range,
+                          int (*fn)(buddy_t *, uint64_t, unsigned)) {
+  while (range.extent >= (1ULL << MIN_BUDDY_SZ_LOG2)) {
+    unsigned i;
+    for (i = bd->max_order; i > MIN_BUDDY_SZ_LOG2; --i)
+      if ((1ULL << i) <= range.extent &&
+          (range.start & ((1ULL << i) - 1)) == 0)
+        break;
+
+    int ret = fn(bd, range.start, i);
+    if (ret != 0)
+      return ret;
+
+    range.start += 1ULL << i;
+    range.extent -= 1ULL << i;
+  }
+  return 0;
+}
+
+static int check_free(buddy_t *bd, uint64_t addr, unsigned log_sz) {
+  return (free_ancestor(bd, addr, log_sz) == -1) ? -1 : 0;
+}
+
+static int reserve_block(buddy_t *bd, uint64_t addr, unsigned log_sz) {
+  int j = free_ancestor(bd, addr, log_sz);
+  assert(j != -1);
+  carve(bd, j, (addr - bd->base) >> j, log_sz, addr);
+  return 0;
+}
+
+int buddy_reserve(buddy_t *bd, range_t range) {
+  /* Round outwards to whole minimum-sized blocks. */
+  uint64_t mask = (1ULL << MIN_BUDDY_SZ_LOG2) - 1;
+  uint64_t end = (range.start + range.extent + mask) & ~mask;
+  range.start &= ~mask;
+  range.extent = end - range.start;
+
+  if (range.start < bd->start || end > bd->start + bd->size)
+    return -1;
+
+  /* Check the whole range is free before touching anything, so a failed
+     reservation leaves the allocator unchanged. */
+  if (for_each_block(bd, range, &check_free) != 0)
+    return -1;
+
+  for_each_block(bd, range, &reserve_block);
+  return 0;
+}
+
+static int aligned_for(uint64_t addr, unsigned lg2) {
+  uint64_t mask = ~( ~0ULL << lg2 );
   return (addr & mask) == 0;
 }
 
+static int free_block(buddy_t *bd, uint64_t addr, unsigned log_sz) {
+  buddy_free(bd, addr, 1ULL << log_sz);
+  return 0;
+}
+
 void buddy_free_range(buddy_t *bd, range_t range) {
-  uintptr_t min_sz = 1 << MIN_BUDDY_SZ_LOG2;
+  uint64_t min_sz = 1ULL << MIN_BUDDY_SZ_LOG2;
+
+  /* Clip the range to the region this allocator manages. */
+  uint64_t end = range.start + range.extent;
+  if (range.start < bd->start)
+    range.start = bd->start;
+  if (end > bd->start + bd->size)
+    end = bd->start + bd->size;
+  if (end <= range.start)
+    return;
+  range.extent = end - range.start;
 
   /* Ensure the range start address is at least aligned to MIN_BUDDY_SZ_LOG2. */
   if (aligned_for(range.start, MIN_BUDDY_SZ_LOG2) == 0) {
-    if (range.extent < min_sz)
+    uint64_t skip = min_sz - (range.start & (min_sz - 1));
+    if (range.extent < skip)
       return;
 
-    range.start &= ~0ULL << MIN_BUDDY_SZ_LOG2;
-    range.start += min_sz;
+    range.start += skip;
+    range.extent -= skip;
   }
 
-  while (range.extent >= min_sz && aligned_for(range.start, MIN_BUDDY_SZ_LOG2)) {
-    
-    for (unsigned i = MAX_BUDDY_SZ_LOG2; i >= MIN_BUDDY_SZ_LOG2; --i) {
-      uintptr_t sz = 1 << i;
-      uint64_t start = range.start - bd->start;
-
-      if (sz > range.extent || aligned_for(start, i) == 0)
-        continue;
-      
-      range.extent -= sz;
-      range.start += sz;
-      buddy_free(bd, start + bd->start, sz);
-      break;
-    }
-
-  }
+  /* Free the largest naturally aligned block that starts at each point. */
+  for_each_block(bd, range, &free_block);
 }
 
-void buddy_free(buddy_t *bd, uint64_t addr, unsigned sz) {
-  uint64_t offs = addr - bd->start;
-  unsigned log_sz = log2_roundup(sz);
+void buddy_free(buddy_t *bd, uint64_t addr, uint64_t sz) {
+  uint64_t offs = addr - bd->base;
+  unsigned log_sz = log2_roundup64(sz);
+  if (log_sz < MIN_BUDDY_SZ_LOG2)
+    log_sz = MIN_BUDDY_SZ_LOG2;
   unsigned idx = offs >> log_sz;
 
-  while (log_sz >= MIN_BUDDY_SZ_LOG2) {
-    int order_idx = log_sz - MIN_BUDDY_SZ_LOG2;
-
-    /* Mark this node free. */
-    bitmap_set(&bd->orders[order_idx], idx);
+  assert(block_in_region(bd, addr, log_sz) && "buddy_free outside region!");
 
-    /* Can we coalesce up another level? */
-    if (log_sz == MAX_BUDDY_SZ_LOG2)
-      break;
+  /* Coalesce up as far as we can. Only the node we end up at is marked
+     free, so a block and its buddy are never both free at once. */
+  for (; log_sz < bd->max_order; ++log_sz) {
+    int order_idx = log_sz - MIN_BUDDY_SZ_LOG2;
 
     /* Is this node's buddy also free? */
-    if (bitmap_isset(&bd->orders[order_idx], BUDDY(idx)) == 0)
+    if (is_free(bd, order_idx, BUDDY(idx)) == 0)
       /* no :( */
       break;
 
-    /* Ensure max(this, buddy) wouldn't go over the max extent
-       of the region. */
-    /* FIXME: ^^ */
+    /* Ensure the parent wouldn't go over the edges of the region. A buddy
+       outside the region can never be marked free, but check anyway rather
+       than trust it. */
+    if (!block_in_region(bd, bd->base + ((uint64_t)DEC_ORDER(idx) << (log_sz+1)),
+                         log_sz+1))
+      break;
 
-    /* Mark them both non free. */
-    bitmap_clear(&bd->orders[order_idx], idx);
-    bitmap_clear(&bd->orders[order_idx], BUDDY(idx));
+    /* Mark the buddy non free. */
+    mark_used(bd, order_idx, BUDDY(idx));
 
     /* Move up an order. */
     idx = DEC_ORDER(idx);
-    ++log_sz;
   }
 
+  /* Mark this node free. */
+  mark_free(bd, log_sz - MIN_BUDDY_SZ_LOG2, idx);
 }
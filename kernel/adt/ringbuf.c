@@ -1,32 +1,28 @@
 #include "adt/ringbuf.h"
+#include "hal.h"
+#include "assert.h"
 
-char_ringbuf_t make_char_ringbuf(char *buffer, int buffer_length) {
-  char_ringbuf_t s;
-  s.buffer = s.buffer_start = s.buffer_end = buffer;
-  s.buffer_length = buffer_length;
+ringbuf_t make_ringbuf(void *buffer, uint32_t elt_sz, uint32_t len) {
+  assert(len != 0 && (len & (len - 1)) == 0 && "Ring buffer length must be a power of two!");
+
+  ringbuf_t s;
+  s.buffer = buffer;
+  s.mask = len - 1;
+  s.elt_sz = elt_sz;
+  s.head = s.tail = 0;
+  s.overflows = 0;
   return s;
 }
 
-int char_ringbuf_read(char_ringbuf_t *state, char *buf, int len) {
-  if (state->buffer_start == state->buffer_end) return 0;
-
-  int n = 0;
-  while (state->buffer_start != state->buffer_end && n < len) {
-    buf[n++] = *state->buffer_start++;
-
-    if (state->buffer_start >= (state->buffer+state->buffer_length))
-      state->buffer_start -= state->buffer_length;
-  }
-  return n;
+int ringbuf_read(ringbuf_t *rb, void *buf, int len) {
+  return ringbuf_read_elts(rb, buf, len, rb->elt_sz);
 }
 
-void char_ringbuf_write(char_ringbuf_t *state, const char *buf, int len) {
-  for (int i = 0; i < len; ++i) {
-    *state->buffer_end++ = buf[i];
+int ringbuf_write(ringbuf_t *rb, const void *buf, int len) {
+  return ringbuf_write_elts(rb, buf, len, rb->elt_sz);
+}
 
-    /* If we are about to run off the end of the buffer, reset to the 
-       start. */
-    if (state->buffer_end >= (state->buffer+state->buffer_length))
-      state->buffer_end -= state->buffer_length;
-  }
+uint32_t ringbuf_used(ringbuf_t *rb) {
+  return __atomic_load_n(&rb->tail, __ATOMIC_ACQUIRE) -
+    __atomic_load_n(&rb->head, __ATOMIC_ACQUIRE);
 }
@@ -41,6 +41,26 @@ _start: mov     eax, pd         ; MAGIC START!
         jmp     higherhalf
 .end:
 
+        ;; Switch from two-level to PAE paging, given the physical address of
+        ;; the new PDPT. Paging must be turned off to change CR4.PAE, so this
+        ;; lives here where it is identity mapped. The stack is in the higher
+        ;; half, so it mustn't be touched until paging is back on.
+global pae_enable:function pae_enable.end-pae_enable
+pae_enable:
+        mov     ecx, [esp+4]    ; PDPT address
+        mov     eax, cr0
+        and     eax, 0x7FFFFFFF ; Clear PG.
+        mov     cr0, eax
+        mov     eax, cr4
+        or      eax, 0x20       ; Set PAE.
+        mov     cr4, eax
+        mov     cr3, ecx
+        mov     eax, cr0
+        or      eax, 0x80000000 ; Set PG.
+        mov     cr0, eax
+        ret
+.end:
+
 section .init.bss nobits
 pd:     resb    0x1000
 pt:     resb    0x1000          ; MAGIC END!
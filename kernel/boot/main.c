@@ -4,6 +4,10 @@ void main(int argc, char *argv) {
   
   init_static_modules();
   kprintf("rOS v%d.%d loaded\n", 0, 1);
+
+  /* Boot is done; hand the memory the PMM held back to the allocators. */
+  release_deferred_memory(~0ULL);
+
   kmain(0, 0);
   kprintf("System is going down, unloading kernel modules\n");
   fini_static_modules();
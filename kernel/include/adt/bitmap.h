@@ -1,19 +1,53 @@
 #ifndef BITMAP_H
 #define BITMAP_H
 
-/* This ADT exposes a statically sized bitmap structure. Initialisation of the type
-   calls the given memory allocator to allocate memory. */
+/* This ADT exposes a statically sized bitmap structure. The caller provides
+   the storage, which must be at least bitmap_calc_overhead() bytes long and
+   32-bit aligned.
+
+   As well as the bits themselves, a summary hierarchy is kept with one bit
+   per 32-bit word that is nonzero, recursively until a level fits in a single
+   word. This means searches for a set bit take O(log32(n)) word reads
+   instead of a linear scan. If BITMAP_TRACK_CLEAR is given, a second
+   hierarchy with one bit per word that is not all ones does the same for
+   clear bits; without it, clear-bit searches scan word by word.
+
+   The storage is laid out with the summary levels first, top level first,
+   followed by the data, so a search walks forwards through memory. */
 
 #include "stdint.h"
+#include "stddef.h"
+
+/* The maximum number of summary levels. 32^6 words covers 2^35 bits. */
+#define BITMAP_MAX_LEVELS 6
+
+/* Flags for bitmap_init() and bitmap_calc_overhead(). */
+#define BITMAP_TRACK_CLEAR 1 /* Keep a summary for fast clear-bit searches. */
 
 /* A bitmap type. */
 typedef struct bitmap {
-  uint8_t *data;
+  uint32_t *data;
+  /* set[l] has one bit per word of the level below (data for l == 0),
+     which is set if that word is nonzero. clr[l] is the same, but for words
+     that are not all ones (for data) or nonzero (for the levels above), and
+     is only kept with BITMAP_TRACK_CLEAR. */
+  uint32_t *set[BITMAP_MAX_LEVELS];
+  uint32_t *clr[BITMAP_MAX_LEVELS];
+  /* Number of words in the data (nwords[0]) and each summary level. */
+  uint32_t nwords[BITMAP_MAX_LEVELS+1];
+  unsigned nlevels;
+  int flags;
   int64_t max_extent;
 } bitmap_t;
 
+/* Returns the number of bytes of storage needed for a bitmap holding
+   indices 0..max_extent inclusive. Always a multiple of 4. */
+size_t bitmap_calc_overhead(int64_t max_extent, int flags);
 
-void bitmap_init(bitmap_t *xb, uint8_t *storage, int64_t max_extent);
+/* Initialise a bitmap with all bits clear, using 'storage' which must be
+   at least bitmap_calc_overhead(max_extent, flags) bytes. */
+void bitmap_init(bitmap_t *xb, uint8_t *storage, int64_t max_extent,
+                 int flags);
 
 /* Sets a bit at index idx. */
 void bitmap_set(bitmap_t *xb, unsigned idx);
@@ -21,6 +55,12 @@ void bitmap_set(bitmap_t *xb, unsigned idx);
 /* Clears a bit at index idx. */
 void bitmap_clear(bitmap_t *xb, unsigned idx);
 
+/* Sets n bits starting at index idx. */
+void bitmap_set_range(bitmap_t *xb, unsigned idx, unsigned n);
+
+/* Clears n bits starting at index idx. */
+void bitmap_clear_range(bitmap_t *xb, unsigned idx, unsigned n);
+
 /* Predicate: returns nonzero if the bit at index idx is set. */
 int bitmap_isset(bitmap_t *xb, unsigned idx);
 
@@ -31,4 +71,16 @@ int bitmap_isclear(bitmap_t *xb, unsigned idx);
    set at all. */
 int64_t bitmap_first_set(bitmap_t *xb);
 
+/* Return the index of the first bit that is clear, or -1 if all bits are
+   set. */
+int64_t bitmap_first_clear(bitmap_t *xb);
+
+/* Return the index of the first set bit at or after 'from', or -1 if there
+   are none. */
+int64_t bitmap_next_set(bitmap_t *xb, unsigned from);
+
+/* Return the index of the first clear bit at or after 'from', or -1 if there
+   are none. */
+int64_t bitmap_next_clear(bitmap_t *xb, unsigned from);
+
 #endif
@@ -1,11 +1,12 @@
 #ifndef BUDDY_H
 #define BUDDY_H
 
-#include "stdint.h"
+#include "types.h"
 #include "adt/bitmap.h"
 
-/* log2 of the maximum buddy node size. */
-#define MAX_BUDDY_SZ_LOG2 28 /* 2^28 = 256MB */
+/* log2 of the maximum buddy node size. Regions larger than this are managed
+   as a forest of maximum-sized roots. */
+#define MAX_BUDDY_SZ_LOG2 32 /* 2^32 = 4GB */
 /* log2 of the minimum buddy node size. */
 #define MIN_BUDDY_SZ_LOG2 12 /* 2^12 = 4KB */
 
@@ -13,15 +14,49 @@
 
 typedef struct buddy {
   uint64_t start, size;
+  /* The address the tree is rooted at - 'start' rounded down to the size of
+     the largest order, so every block is naturally aligned. */
+  uint64_t base;
+  /* log2 of the largest block that fits in the region. */
+  unsigned max_order;
+  /* The top order has a bitmap with a bit set for every free block. Below
+     it a block and its buddy are never both free, so each pair of buddies
+     is kept in 'pairs' as one of three states, five pairs to a byte, and
+     the order's bitmap only has a bit set for every word of 'pairs' with a
+     free block in it. Blocks that end at or before 'start' are never free,
+     so each order begins at block first[order] rather than at 'base'. */
   bitmap_t orders[NUM_BUDDY_BUCKETS];
+  uint32_t *pairs[NUM_BUDDY_BUCKETS];
+  uint32_t first[NUM_BUDDY_BUCKETS];
+  /* The number of free blocks in each order. */
+  uint32_t nfree[NUM_BUDDY_BUCKETS];
+  /* Bit i is set if order i has any free blocks. */
+  uint32_t free_orders;
 } buddy_t;
 
 size_t buddy_calc_overhead(range_t r);
 int buddy_init(buddy_t *bd, uint8_t *overhead_storage,
                range_t r, int start_freed);
-uint64_t buddy_alloc(buddy_t *bd, unsigned sz);
+/* Allocate a naturally aligned block of at least 'sz' bytes. Returns ~0ULL
+   if no block is free, or 'sz' is larger than the region could ever hold.
+   Not O(1): finding the order is one bsf, but finding a free block in it
+   is an O(log32 n) bitmap search, and splitting it down is O(log n). */
+uint64_t buddy_alloc(buddy_t *bd, uint64_t sz);
+/* Allocate up to 'n' blocks of at least 'sz' bytes each, storing their
+   addresses in 'out'. Returns the number allocated, which is less than 'n'
+   only if the allocator ran out. */
+size_t buddy_alloc_batch(buddy_t *bd, uint64_t sz, size_t n, uint64_t *out);
+/* Allocate a block of at least 'sz' bytes whose address is a multiple of
+   'align' (a power of two). Returns ~0ULL on failure. */
+uint64_t buddy_alloc_aligned(buddy_t *bd, uint64_t sz, uint64_t align);
+/* Mark 'range' (rounded outwards to whole minimum-sized blocks) as
+   allocated. Returns -1 without changing anything if any part of it is
+   outside the region or not free. Free it again with buddy_free_range. */
+int buddy_reserve(buddy_t *bd, range_t range);
+/* Free every whole minimum-sized block in 'range' that lies inside the
+   region. The range need not be aligned. */
 void buddy_free_range(buddy_t *bd, range_t range);
-void buddy_free(buddy_t *bd, uint64_t addr, unsigned sz);
+void buddy_free(buddy_t *bd, uint64_t addr, uint64_t sz);
 
 extern buddy_t kernel_buddy;
 
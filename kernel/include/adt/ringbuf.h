@@ -1,27 +1,133 @@
 #ifndef RINGBUF_H
 #define RINGBUF_H
 
-/* Ring buffer storing characters
+/* Single-producer, single-consumer ring buffer
  *
- * This ADT exposes a circular buffer, each item being of @c char type. It is minimal
- * and not in any way threadsafe. It has no dependencies. */
+ * This ADT exposes a circular buffer of fixed-size elements. It is safe
+ * without locks as long as there is at most one writer and one reader at a
+ * time - for example an interrupt handler filling it and a thread draining
+ * it - because each side only ever stores to its own index.
+ *
+ * The capacity must be a power of two. The head and tail indices run freely
+ * and are masked on use, so the buffer can be completely filled and
+ * "full" is never confused with "empty".
+ *
+ * The generic functions use the element size stored in the ring buffer;
+ * DEFINE_RINGBUF generates a typed wrapper whose reads and writes are
+ * inlined with the size as a compile-time constant instead. Writes that
+ * don't fit are truncated and the number of dropped elements is added to
+ * 'overflows'. */
 
-/* A ring buffer storing characters. */
-typedef struct char_ringbuf {
-  char *buffer, *buffer_start, *buffer_end;
-  int buffer_length;
-} char_ringbuf_t;
+#include "stdint.h"
+
+/* A ring buffer of elements of 'elt_sz' bytes. */
+typedef struct ringbuf {
+  uint8_t *buffer;
+  uint32_t mask;           /* Capacity in elements, minus one. */
+  uint32_t elt_sz;
+  uint32_t head;           /* Next element to read. Only the reader stores. */
+  uint32_t tail;           /* Next element to write. Only the writer stores. */
+  uint32_t overflows;      /* Elements dropped by writes. Writer only. */
+} ringbuf_t;
+
+/* Create a new ring buffer using 'buffer' as memory, which holds 'len'
+   elements of 'elt_sz' bytes. 'len' must be a power of two. */
+ringbuf_t make_ringbuf(void *buffer, uint32_t elt_sz, uint32_t len);
+
+/* Read up to 'len' elements into 'buf', returning the number read. Must
+   only be called by the reader. */
+int ringbuf_read(ringbuf_t *rb, void *buf, int len);
+
+/* Write up to 'len' elements from 'buf', returning the number written. Any
+   that don't fit are counted in 'overflows'. Must only be called by the
+   writer. */
+int ringbuf_write(ringbuf_t *rb, const void *buf, int len);
+
+/* Returns the number of elements available to read. Exact when called by
+   the reader, a lower bound when called by anyone else. */
+uint32_t ringbuf_used(ringbuf_t *rb);
+
+/* The implementation of ringbuf_read() and ringbuf_write(), taking the
+   element size as a parameter so that DEFINE_RINGBUF's wrappers can make
+   it a constant. */
+
+/* Copy 'n' elements between the ring at index 'idx' and 'buf', in at most
+   two pieces: up to the end of the storage, then from the start. */
+static inline void ringbuf_copy_out(ringbuf_t *rb, uint32_t idx, uint8_t *buf,
+                                    uint32_t n, uint32_t elt_sz) {
+  uint32_t offs = idx & rb->mask;
+  uint32_t first = (n < rb->mask + 1 - offs) ? n : rb->mask + 1 - offs;
 
+  __builtin_memcpy(buf, &rb->buffer[offs * elt_sz], first * elt_sz);
+  __builtin_memcpy(&buf[first * elt_sz], rb->buffer, (n - first) * elt_sz);
+}
 
-/* Create a new character ring buffer, using 'buffer' as memory, which is 'len' bytes
-   long. */
-char_ringbuf_t make_char_ringbuf(char *buffer, int len);
+static inline void ringbuf_copy_in(ringbuf_t *rb, uint32_t idx,
+                                   const uint8_t *buf, uint32_t n,
+                                   uint32_t elt_sz) {
+  uint32_t offs = idx & rb->mask;
+  uint32_t first = (n < rb->mask + 1 - offs) ? n : rb->mask + 1 - offs;
 
-/* Read len characters from a char ring buffer. */
-int char_ringbuf_read(char_ringbuf_t *state, char *buf, int len);
+  __builtin_memcpy(&rb->buffer[offs * elt_sz], buf, first * elt_sz);
+  __builtin_memcpy(rb->buffer, &buf[first * elt_sz], (n - first) * elt_sz);
+}
 
-/* Write len characters to a char ring buffer. This does not guarantee that all
-   elements were written successfully. */
-void char_ringbuf_write(char_ringbuf_t *state, const char *buf, int len);
+/* The writer publishes elements by storing 'tail' with release semantics
+   after copying them in; the reader loads it with acquire semantics before
+   copying them out. 'head' works the same way in the other direction, so
+   the writer never overwrites an element that is still being read. */
+
+static inline int ringbuf_read_elts(ringbuf_t *rb, void *buf, int len,
+                                    uint32_t elt_sz) {
+  uint32_t head = rb->head;
+  uint32_t used = __atomic_load_n(&rb->tail, __ATOMIC_ACQUIRE) - head;
+  uint32_t n = ((uint32_t)len < used) ? (uint32_t)len : used;
+
+  if (n == 0)
+    return 0;
+
+  ringbuf_copy_out(rb, head, buf, n, elt_sz);
+  __atomic_store_n(&rb->head, head + n, __ATOMIC_RELEASE);
+  return n;
+}
+
+static inline int ringbuf_write_elts(ringbuf_t *rb, const void *buf, int len,
+                                     uint32_t elt_sz) {
+  uint32_t tail = rb->tail;
+  uint32_t space = rb->mask + 1 -
+    (tail - __atomic_load_n(&rb->head, __ATOMIC_ACQUIRE));
+  uint32_t n = ((uint32_t)len < space) ? (uint32_t)len : space;
+
+  rb->overflows += len - n;
+  if (n == 0)
+    return 0;
+
+  ringbuf_copy_in(rb, tail, buf, n, elt_sz);
+  __atomic_store_n(&rb->tail, tail + n, __ATOMIC_RELEASE);
+  return n;
+}
+
+/* Define a ring buffer type 'name'_t of elements of type 'type', with
+   make_'name', 'name'_read, 'name'_write and 'name'_used operations. */
+#define DEFINE_RINGBUF(name, type)                                      \
+  typedef struct name { ringbuf_t rb; } name##_t;                       \
+                                                                        \
+  static inline name##_t make_##name(type *buffer, uint32_t len) {      \
+    name##_t s;                                                         \
+    s.rb = make_ringbuf(buffer, sizeof(type), len);                     \
+    return s;                                                           \
+  }                                                                     \
+  static inline int name##_read(name##_t *s, type *buf, int len) {      \
+    return ringbuf_read_elts(&s->rb, buf, len, sizeof(type));           \
+  }                                                                     \
+  static inline int name##_write(name##_t *s, const type *buf, int len) { \
+    return ringbuf_write_elts(&s->rb, buf, len, sizeof(type));          \
+  }                                                                     \
+  static inline uint32_t name##_used(name##_t *s) {                     \
+    return ringbuf_used(&s->rb);                                        \
+  }
+
+/* A ring buffer storing characters. */
+DEFINE_RINGBUF(char_ringbuf, char)
 
 #endif
@@ -168,12 +168,17 @@ void send_ipi(int proc_id, void *data);
 #define X86_PRESENT 0x1
 #define X86_WRITE   0x2
 #define X86_USER    0x4
+#define X86_PS      0x80  /* In a directory entry: maps a large page */
+#define X86_GLOBAL  0x100 /* Kept in the TLB across CR3 writes */
 #define X86_EXECUTE 0x200
 #define X86_COW     0x400
+#define X86_LAZY    0x800 /* Not present: back with a zeroed page on touch */
+#define X86_SHARED  0x400 /* In a directory entry: the table is shared
+                             copy-on-write with another address space */
 
 typedef struct address_space {
   uint32_t *directory;
-  spinlock_t lock;
+  struct address_space *next; /* All address spaces, for kernel updates */
 } address_space_t;
 
 static inline unsigned get_page_size() {
@@ -210,6 +215,8 @@ static inline uintptr_t round_to_page_size(uintptr_t x) {
 #define PAGE_REQ_NONE     0 /* No requirements on page location */
 #define PAGE_REQ_UNDER1MB 1 /* Require that the returned page be < 0x100000 */
 #define PAGE_REQ_UNDER4GB 2 /* Require that the returned page be < 0x10000000 */
+#define PAGE_REQ_ZERO     8 /* Flag: the returned pages must be zero-filled. May
+                               be OR'd with any of the above. */
 
 /* Returns the (default) page size in bytes. Not all pages may be this size
    (large pages etc.) */
@@ -236,11 +243,45 @@ int free_page(uint64_t page);
 uint64_t alloc_pages(int req, size_t num);
 int free_pages(uint64_t pages, size_t num);
 
+/* Allocate up to 'n' runs of 'num' physically contiguous pages each, under
+   a single lock acquisition, storing their addresses in 'out'. Returns the
+   number of runs allocated. */
+size_t alloc_pages_batch(int req, size_t num, size_t n, uint64_t *out);
+
+/* Allocate 'num' physically contiguous pages whose address is a multiple
+   of 'align' bytes (a power of two). Returns ~0ULL on failure. */
+uint64_t alloc_pages_aligned(int req, size_t num, size_t align);
+
+/* Zero up to 'max' free pages ahead of time, so that later PAGE_REQ_ZERO
+   allocations don't have to. Meant to be called when there is nothing
+   better to do; free_page() and release_deferred_memory() also refill the
+   pools as pages come back. Returns the number of pages zeroed. */
+unsigned prezero_pages(unsigned max);
+
+/* Only part of physical memory is made available during boot. Release up
+   to 'max' bytes more of it, returning the number of bytes released (zero
+   once everything has been). main() releases the rest once every module
+   has started; allocations before that release memory on demand. */
+uint64_t release_deferred_memory(uint64_t max);
+
+/* Fill the physical page 'p' with zeroes. It need not be mapped. */
+void zero_page(uint64_t p);
+
 /* Creates a new address space based on the current one and stores it in
    'dest'. If 'make_cow' is nonzero, all pages marked WRITE are modified so
-   that they are copy-on-write. */
+   that they are copy-on-write. Returns -1 if the directories can't be
+   allocated. */
 int clone_address_space(address_space_t *dest, int make_cow);
 
+/* Creates a new address space with an empty user half, sharing only kernel
+   space with the others, and stores it in 'dest'. Returns -1 on failure. */
+int create_address_space(address_space_t *dest);
+
+/* Frees the user half page tables of 'as', which must not be in use, and
+   drops its copy-on-write references. As with unmap(), the pages it mapped
+   aren't freed. Returns -1 on failure. */
+int destroy_address_space(address_space_t *as);
+
 /* Switches address space. Returns -1 on failure. */
 int switch_address_space(address_space_t *dest);
 
@@ -257,11 +298,54 @@ int map(uintptr_t v, uint64_t p, int num_pages,
    space. Returns zero on success or -1 on failure. */
 int unmap(uintptr_t v, int num_pages);
 
+/* Replaces the mapping of the page at 'v' with 'p' and 'flags' if it still
+   maps 'old'. A copy-on-write page can only be made writable in place
+   (p == old) if this is its last mapping.
+
+   Returns zero on success or -1 on failure. */
+int remap(uintptr_t v, uint64_t old, uint64_t p, unsigned flags);
+
+/* Copies get_page_size() bytes from 'src' into the physical page 'p'. */
+void copy_to_page(uint64_t p, const void *src);
+
+/* Maps the physical page 'p' into one of this core's temporary slots and
+   returns its address, for one PTE write and one invlpg. Interrupts are
+   off until the matching kunmap_atomic(). Mappings may nest a few deep,
+   and must be released in reverse order. */
+void *kmap_atomic(uint64_t p);
+/* Releases the most recent kmap_atomic() mapping, 'v'. */
+void kunmap_atomic(void *v);
+
+/* Reserves 'num_pages' * get_page_size() bytes from 'v' in the current
+   virtual address space without backing them. Each page is given a zeroed
+   physical page, mapped with 'flags', when it is first touched. unmap()
+   drops the reservation; it doesn't free pages that were backed.
+
+   Returns zero on success or -1 on failure. */
+int map_lazy(uintptr_t v, int num_pages, unsigned flags);
+
+/* Backs any pages reserved by map_lazy() in 'num_pages' from 'v' now
+   rather than on first touch. Returns zero on success or -1 on failure. */
+int populate(uintptr_t v, int num_pages);
+
 /* If 'v' has a V->P mapping associated with it, return 'v'. Else return
    the next page (multiple of get_page_size()) which has a mapping associated
    with it. */
 uintptr_t iterate_mappings(uintptr_t v);
 
+/* A run of virtually contiguous pages mapped to physically contiguous
+   memory with the same flags. 'end' is the address of the last byte. */
+typedef struct mapping_run {
+  uintptr_t start, end;
+  uint64_t phys;
+  unsigned flags;
+} mapping_run_t;
+
+/* Find the first run of mappings at or above 'v' in the current address
+   space, skipping unmapped page tables whole. Returns 0 and fills in
+   'run', or -1 if nothing at or above 'v' is mapped. */
+int next_mapping_run(uintptr_t v, mapping_run_t *run);
+
 /* If 'v' is mapped, return the physical page it is mapped to
    and fill 'flags' with the mapping flags. Else return ~0ULL. */
 uint64_t get_mapping(uintptr_t v, unsigned *flags);
@@ -269,16 +353,19 @@ uint64_t get_mapping(uintptr_t v, unsigned *flags);
 /* Return 1 if 'v' is mapped, else 0, or -1 if not implemented. */
 int is_mapped(uintptr_t v);
 
-/* A range of memory, with a start and a size. */
-typedef struct range {
-  uint64_t start;
-  uint64_t extent;
-} range_t;
+/* Returns the size of the large pages that map() uses for suitably
+   aligned runs, or 0 if there are none. */
+unsigned get_large_page_size();
+
+/* Returns one past the highest physical address that map() can map. */
+uint64_t get_physical_address_limit();
 
-/* Initialise the virtual memory manager.
+/* Initialise the virtual memory manager. 'ranges' describes physical
+   memory, and is used to decide whether the paging mode needs to reach
+   above 4GB.
    
    Returns 0 on success or -1 on failure. */
-int init_virtual_memory();
+int init_virtual_memory(range_t *ranges, unsigned nranges);
 
 /* Initialise the physical memory manager (stage 1), passing in a set
    of ranges and the maximum extent of physical memory
@@ -292,8 +379,33 @@ int init_physical_memory_early(range_t *ranges, unsigned nranges,
    done after the virtual memory manager is set up. */
 int init_physical_memory();
 
-/* Initialise the copy-on-write page reference counts. */
-int init_cow_refcnts(range_t *ranges, unsigned nranges);
+/* The state of a physical page frame, kept in one descriptor per frame so
+   that everything about a frame is found with one lookup. */
+typedef struct page_frame {
+  uint16_t refcnt;   /* Number of copy-on-write mappings of the frame, or,
+                        for a PF_TABLE frame, the number of directories
+                        sharing the table (X86_SHARED entries). */
+  uint8_t  flags;    /* PF_* */
+  uint8_t  order;    /* log2 pages in the block this frame heads, if any. */
+  union {
+    void    *owner;  /* The slab cache or vmspace the frame belongs to. */
+    unsigned nused;  /* Entries in use, if the frame is a page table. */
+  } u;
+} page_frame_t;
+
+#define PF_SLAB    1 /* Owned by the slab_cache_t in 'u.owner' */
+#define PF_VMSPACE 2 /* Owned by the vmspace_t in 'u.owner' */
+#define PF_HEAD    4 /* First frame of a block of 2^order frames */
+#define PF_TABLE   8 /* A user page table, with its entry count in 'u.nused' */
+
+/* Initialise the page frame database for the given ranges of RAM. Only the
+   parts of the database that describe these ranges are backed by memory, so
+   holes in the physical address space cost nothing. */
+int init_page_frames(range_t *ranges, unsigned nranges);
+
+/* Return the descriptor for the frame containing physical address 'p',
+   which must lie in one of the ranges given to init_page_frames(). */
+page_frame_t *get_page_frame(uint64_t p);
 
 /* Increment the reference count of a copy-on-write page. */
 void cow_refcnt_inc(uint64_t p);
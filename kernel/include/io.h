@@ -8,6 +8,10 @@
 #define CR0_PG  (1U<<31)  /* Paging enable */
 #define CR0_WP  (1U<<16)  /* Write-protect - allow page faults in kernel mode */
 
+#define CR4_PSE (1U<<4)   /* Page size extensions - 4MB pages */
+#define CR4_PAE (1U<<5)   /* Physical address extension */
+#define CR4_PGE (1U<<7)   /* Page global enable */
+
 static inline void outb(unsigned short port, uint8_t value) {
   __asm__ volatile ("outb %1, %0" : : "dN" (port), "a" (value));
 }
@@ -54,6 +58,12 @@ static inline unsigned int read_cr3() {
   return ret;
 }
 
+static inline unsigned int read_cr4() {
+  unsigned int ret;
+  __asm__ volatile("mov %%cr4, %0" : "=r" (ret));
+  return ret;
+}
+
 static inline void write_cr0(unsigned int val) {
   __asm__ volatile("mov %0, %%cr0" : : "r" (val));
 }
@@ -63,5 +73,15 @@ static inline void write_cr2(unsigned int val) {
 static inline void write_cr3(unsigned int val) {
   __asm__ volatile("mov %0, %%cr3" : : "r" (val));
 }
+static inline void write_cr4(unsigned int val) {
+  __asm__ volatile("mov %0, %%cr4" : : "r" (val));
+}
+
+/* Read the timestamp counter. */
+static inline uint64_t rdtsc() {
+  uint32_t lo, hi;
+  __asm__ volatile("rdtsc" : "=a" (lo), "=d" (hi));
+  return ((uint64_t)hi << 32) | lo;
+}
 
 #endif
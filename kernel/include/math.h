@@ -1,6 +1,9 @@
 #ifndef MATH_H
 #define MATH_H
 
+#include "stdint.h"
+
 unsigned log2_roundup(unsigned n);
+unsigned log2_roundup64(uint64_t n);
 
 #endif
@@ -3,7 +3,7 @@
 
 #define MMAP_KERNEL_START 0xC0000000
 
-#define MMAP_COW_REFCNTS  0xCC000000 /* At least 64MB of address space for 36-bit
+#define MMAP_PAGE_FRAMES  0xC8000000 /* 128MB of page_frame_t, enough for 36-bit
                                         physical addresses */
 #define MMAP_KERNEL_VMSPACE_START \
                           0xD0000000
@@ -11,9 +11,20 @@
                           0xFE800000
 
 #define MMAP_PMM_BITMAP   0xFE800000
-#define MMAP_PMM_BITMAP_END 0xFF800000
+#define MMAP_PMM_BITMAP_END 0xFF7DC000
 
-#define MMAP_KERNEL_END   0xFF800000
+/* The fixmap: pages at fixed addresses whose mappings change on the fly. */
+#define MMAP_FIXMAP       0xFF7DC000
+#define MMAP_KMAP         0xFF7DC000 /* MMAP_KMAP_SLOTS pages per core
+                                        (MAX_CORES) for kmap_atomic() */
+#define MMAP_KMAP_SLOTS   4
+#define MMAP_SCRATCH      0xFF7FC000 /* Windows for building the PAE page
+                                        tables at boot */
+#define MMAP_SCRATCH_SLOTS 4
+#define MMAP_FIXMAP_END   0xFF800000
+
+#define MMAP_KERNEL_END   0xFF800000 /* The recursive page table map is above
+                                        here: 4MB normally, 8MB with PAE */
 
 #define IS_KERNEL_ADDR(x) ((void*)(x) >= (void*)MMAP_KERNEL_START)
 
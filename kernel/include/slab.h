@@ -7,9 +7,13 @@
 
 typedef struct slab_cache {
   unsigned size;
+  /* Bytes per object in a slab: 'size', but at least big enough to hold
+     the free list link. */
+  unsigned stride;
   void *init;
-  struct slab_footer *first;
-  void *empty;
+  /* Slabs with some objects free, with none free, and with all free. */
+  struct slab_footer *partial, *full, *empty;
+  unsigned nempty;
   vmspace_t *vms;
 
   spinlock_t lock;
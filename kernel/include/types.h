@@ -8,4 +8,10 @@
 #undef NULL
 #define NULL 0
 
+/* A range of memory, with a start and a size. */
+typedef struct range {
+  uint64_t start;
+  uint64_t extent;
+} range_t;
+
 #endif // TYPES_H
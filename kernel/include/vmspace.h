@@ -11,9 +11,16 @@ typedef struct vmspace {
   spinlock_t lock;
 } vmspace_t;
 
+/* OR'd into vmspace_alloc's 'alloc_phys' flags: only reserve the region,
+   and give each page physical memory when it is first touched. */
+#define VMSPACE_LAZY 0x100
+
 int vmspace_init(vmspace_t *vms, uintptr_t addr, uintptr_t sz);
 uintptr_t vmspace_alloc(vmspace_t *vms, unsigned sz, int alloc_phys);
 void vmspace_free(vmspace_t *vms, unsigned sz, uintptr_t addr, int free_phys);
+/* Back every page of a VMSPACE_LAZY region now, for callers that are about
+   to touch all of it anyway. */
+void vmspace_populate(vmspace_t *vms, uintptr_t addr, unsigned sz);
 
 extern vmspace_t kernel_vmspace;
 
@@ -0,0 +1,41 @@
+#include "assert.h"
+#include "hal.h"
+#include "mmap.h"
+
+static page_frame_t *frames = (page_frame_t*) MMAP_PAGE_FRAMES;
+
+page_frame_t *get_page_frame(uint64_t p) {
+  return &frames[p >> get_page_shift()];
+}
+
+/* Back the page of the database holding the descriptor for frame 'p'. */
+static void init_page(uint64_t p) {
+  uintptr_t backing_page = (uintptr_t)get_page_frame(p) & ~get_page_mask();
+
+  if (!is_mapped(backing_page)) {
+    uint64_t page = alloc_page(PAGE_REQ_NONE | PAGE_REQ_ZERO);
+    assert(page != ~0ULL && "alloc_page failed!");
+    int ret = map(backing_page, page, 1, PAGE_WRITE);
+    assert(ret != -1 && "map failed!");
+  }
+}
+
+int init_page_frames(range_t *ranges, unsigned nranges) {
+  /* One backing page holds the descriptors for this many frames, so step by
+     that rather than checking every frame. */
+  uint64_t step = (uint64_t)(get_page_size() / sizeof(page_frame_t)) <<
+    get_page_shift();
+
+  uint64_t limit = get_physical_address_limit();
+
+  for (unsigned i = 0; i < nranges; ++i) {
+    if (ranges[i].extent == 0 || ranges[i].start >= limit)
+      continue;
+    uint64_t end = ranges[i].start + ranges[i].extent;
+    if (end > limit)
+      end = limit;
+    for (uint64_t p = ranges[i].start & ~(step - 1); p < end; p += step)
+      init_page(p);
+  }
+  return 0;
+}
@@ -4,6 +4,7 @@
 #include "mmap.h"
 #include "adt/buddy.h"
 #include "string.h"
+#include "io.h"
 
 #define dbg(...)
 
@@ -23,6 +24,17 @@ uint64_t early_max_extent;
 static spinlock_t lock = SPINLOCK_RELEASED;
 static buddy_t allocators[3];
 
+/* Only this much memory above 1MB is handed to the buddy allocators during
+   boot. The rest is queued in 'deferred' and released PMM_DEFER_CHUNK at a
+   time by release_deferred_memory(), or on demand when an allocation
+   fails, so boot time doesn't grow with the amount of RAM. */
+#define PMM_BOOT_CHUNK  (32ULL << 20)
+#define PMM_DEFER_CHUNK (64ULL << 20)
+
+static range_t  deferred[3][64];
+static unsigned ndeferred[3];
+static uint64_t deferred_bytes, deferred_cycles;
+
 static range_t split_range(range_t *r, uint64_t loc) {
   range_t ret;
 
@@ -42,11 +54,79 @@ static range_t split_range(range_t *r, uint64_t loc) {
   return ret;
 }
 
-uint64_t alloc_page(int req) {
-  return alloc_pages(req, 1);
+/* Returns the zone (PAGE_REQ_*) that the physical address 'p' belongs to. */
+static int zone_for(uint64_t p) {
+  if (p < 0x100000)
+    return PAGE_REQ_UNDER1MB;
+  else if (p < 0x100000000ULL)
+    return PAGE_REQ_UNDER4GB;
+  return PAGE_REQ_NONE;
 }
 
-uint64_t alloc_pages(int req, size_t num) {
+static void defer_range(int req, range_t r) {
+  if (ndeferred[req] == sizeof(deferred[req]) / sizeof(range_t)) {
+    /* No room to queue it; just free it now. */
+    buddy_free_range(&allocators[req], r);
+    return;
+  }
+  deferred[req][ndeferred[req]++] = r;
+  deferred_bytes += r.extent;
+}
+
+/* Release up to PMM_DEFER_CHUNK of deferred memory from zone 'req', or
+   from any zone if 'req' is -1. Returns the number of bytes released. */
+static uint64_t release_chunk(int req) {
+  uint64_t released = 0;
+  uint64_t t = rdtsc();
+
+  spinlock_acquire(&lock);
+  for (int z = 0; z < 3 && released == 0; ++z) {
+    if (req != -1 && z != req)
+      continue;
+    if (ndeferred[z] == 0)
+      continue;
+
+    range_t *last = &deferred[z][ndeferred[z] - 1];
+    range_t r = split_range(last, last->start + PMM_DEFER_CHUNK);
+    if (last->extent == 0)
+      --ndeferred[z];
+
+    buddy_free_range(&allocators[z], r);
+    released = r.extent;
+  }
+  deferred_bytes -= released;
+  deferred_cycles += rdtsc() - t;
+  uint64_t left = deferred_bytes;
+  spinlock_release(&lock);
+
+  if (released && left == 0)
+    kprintf("pmm: all deferred memory released, %d cycles kept off the "
+            "boot path\n", (int)deferred_cycles);
+  return released;
+}
+
+uint64_t release_deferred_memory(uint64_t max) {
+  uint64_t released = 0, r;
+  while (released < max && (r = release_chunk(-1)) != 0)
+    released += r;
+
+  /* The NONE zone has nothing to fill its pool from until its memory is
+     released, so this is the point to top the pools up. */
+  if (released != 0)
+    prezero_pages(~0U);
+  return released;
+}
+
+/* Release deferred memory that could satisfy a request of zone 'req',
+   after an allocation from it failed. A NONE request can also be met from
+   the UNDER4GB zone. Returns nonzero if anything was released. */
+static int release_for(int req) {
+  if (release_chunk(req) != 0)
+    return 1;
+  return req == PAGE_REQ_NONE && release_chunk(PAGE_REQ_UNDER4GB) != 0;
+}
+
+static uint64_t alloc_buddy(int req, size_t num) {
   dbg("alloc_pages: get lock\n");
   spinlock_acquire(&lock);
   dbg("alloc_pages: got lock\n");
@@ -59,20 +139,290 @@ uint64_t alloc_pages(int req, size_t num) {
   return val;
 }
 
+static size_t alloc_buddy_batch(int req, size_t num, size_t n, uint64_t *out) {
+  spinlock_acquire(&lock);
+  size_t got = buddy_alloc_batch(&allocators[req], num * get_page_size(),
+                                 n, out);
+
+  if (got < n && req == PAGE_REQ_NONE)
+    got += buddy_alloc_batch(&allocators[PAGE_REQ_UNDER4GB],
+                             num * get_page_size(), n - got, &out[got]);
+
+  spinlock_release(&lock);
+  return got;
+}
+
+/* Each core keeps a small magazine of free single pages per zone, so the
+   common alloc_page()/free_page() calls don't touch the global lock. A
+   magazine is refilled with PCP_BATCH pages at once when it runs dry and
+   half emptied back to the buddy allocator when it fills up.
+
+   A magazine is only ever touched by its own core with interrupts
+   disabled, so it needs no lock. The NONE magazine may hold pages from
+   under 4GB, the same as alloc_pages() would return on fallback. */
+#define PCP_MAX   32
+#define PCP_BATCH 16
+
+typedef struct pcp {
+  unsigned n;
+  uint64_t pages[PCP_MAX];
+} pcp_t;
+
+static pcp_t pcps[MAX_CORES][3];
+
+static pcp_t *get_pcp(int req) {
+  int id = get_processor_id();
+  return &pcps[(id == -1) ? 0 : id][req];
+}
+
+static uint64_t pcp_alloc(int req) {
+  int ints = get_interrupt_state();
+  disable_interrupts();
+
+  pcp_t *pcp = get_pcp(req);
+  if (pcp->n == 0)
+    pcp->n = alloc_buddy_batch(req, 1, PCP_BATCH, pcp->pages);
+
+  uint64_t val = (pcp->n > 0) ? pcp->pages[--pcp->n] : ~0ULL;
+
+  set_interrupt_state(ints);
+  return val;
+}
+
+static void pcp_free(uint64_t page) {
+  int ints = get_interrupt_state();
+  disable_interrupts();
+
+  pcp_t *pcp = get_pcp(zone_for(page));
+  if (pcp->n == PCP_MAX) {
+    spinlock_acquire(&lock);
+    for (unsigned i = PCP_MAX - PCP_BATCH; i < PCP_MAX; ++i)
+      buddy_free(&allocators[zone_for(pcp->pages[i])], pcp->pages[i],
+                 get_page_size());
+    spinlock_release(&lock);
+    pcp->n -= PCP_BATCH;
+  }
+  pcp->pages[pcp->n++] = page;
+
+  set_interrupt_state(ints);
+}
+
+/* Give every page in this core's magazines back to the buddy allocators,
+   so they can coalesce into a larger block. Magazines on other cores are
+   left alone; there are at most PCP_MAX pages per zone in each. */
+static void pcp_drain() {
+  int ints = get_interrupt_state();
+  disable_interrupts();
+
+  spinlock_acquire(&lock);
+  for (unsigned req = 0; req < 3; ++req) {
+    pcp_t *pcp = get_pcp(req);
+    for (unsigned i = 0; i < pcp->n; ++i)
+      buddy_free(&allocators[zone_for(pcp->pages[i])], pcp->pages[i],
+                 get_page_size());
+    pcp->n = 0;
+  }
+  spinlock_release(&lock);
+
+  set_interrupt_state(ints);
+}
+
+/* Pages that are known to be zero-filled, one pool per zone and protected
+   by 'lock'. prezero_pages() fills them ahead of time so that single page
+   PAGE_REQ_ZERO allocations, such as new page tables, don't have to clear
+   a page on the fault path. A NONE request may also take from the
+   UNDER4GB pool, the same as alloc_pages() falls back.
+
+   There is no idle loop to keep the pools topped up, so they are refilled
+   as pages come back instead: while a pool is below ZERO_POOL_LOW, a freed
+   single page is zeroed into it rather than cached, and
+   release_deferred_memory() tops every pool back up to ZERO_POOL_MAX. */
+#define ZERO_POOL_MAX 64
+#define ZERO_POOL_LOW 16
+
+static uint64_t zero_pool[3][ZERO_POOL_MAX];
+static unsigned zero_pool_n[3];
+
+static uint64_t zero_pool_take(int req) {
+  uint64_t val = ~0ULL;
+
+  spinlock_acquire(&lock);
+  if (zero_pool_n[req] == 0 && req == PAGE_REQ_NONE)
+    req = PAGE_REQ_UNDER4GB;
+  if (zero_pool_n[req] > 0)
+    val = zero_pool[req][--zero_pool_n[req]];
+  spinlock_release(&lock);
+
+  return val;
+}
+
+unsigned prezero_pages(unsigned max) {
+  static const int zones[] = {PAGE_REQ_UNDER4GB, PAGE_REQ_NONE};
+  unsigned n = 0;
+
+  if (pmm_init_stage != PMM_INIT_FULL)
+    return 0;
+
+  for (unsigned i = 0; i < sizeof(zones)/sizeof(zones[0]); ++i) {
+    int req = zones[i];
+    while (n < max && zero_pool_n[req] < ZERO_POOL_MAX) {
+      spinlock_acquire(&lock);
+      uint64_t p = buddy_alloc(&allocators[req], get_page_size());
+      spinlock_release(&lock);
+      if (p == ~0ULL)
+        break;
+
+      /* Zero outside the lock; nobody else knows about this page yet. */
+      zero_page(p);
+      ++n;
+
+      spinlock_acquire(&lock);
+      if (zero_pool_n[req] < ZERO_POOL_MAX)
+        zero_pool[req][zero_pool_n[req]++] = p;
+      else
+        buddy_free(&allocators[req], p, get_page_size());
+      spinlock_release(&lock);
+    }
+  }
+  return n;
+}
+
+/* Zero the freed page 'page' into its zone's pool if the pool is running
+   low. Returns nonzero if the page was taken. */
+static int zero_pool_refill(uint64_t page) {
+  int req = zone_for(page);
+  /* Only a hint; the pool is checked again under the lock. */
+  if (req == PAGE_REQ_UNDER1MB || zero_pool_n[req] >= ZERO_POOL_LOW)
+    return 0;
+
+  zero_page(page);
+
+  spinlock_acquire(&lock);
+  if (zero_pool_n[req] < ZERO_POOL_MAX)
+    zero_pool[req][zero_pool_n[req]++] = page;
+  else
+    buddy_free(&allocators[req], page, get_page_size());
+  spinlock_release(&lock);
+  return 1;
+}
+
+/* Give back everything held in this core's magazines and in the zero
+   pools. */
+static void drain_caches() {
+  pcp_drain();
+
+  spinlock_acquire(&lock);
+  for (unsigned req = 0; req < 3; ++req) {
+    for (unsigned i = 0; i < zero_pool_n[req]; ++i)
+      buddy_free(&allocators[zone_for(zero_pool[req][i])], zero_pool[req][i],
+                 get_page_size());
+    zero_pool_n[req] = 0;
+  }
+  spinlock_release(&lock);
+}
+
+static void zero_pages(uint64_t p, size_t num) {
+  for (size_t i = 0; i < num; ++i)
+    zero_page(p + i * get_page_size());
+}
+
+uint64_t alloc_page(int req) {
+  return alloc_pages(req, 1);
+}
+
+uint64_t alloc_pages(int req, size_t num) {
+  int zero = req & PAGE_REQ_ZERO;
+  req &= ~PAGE_REQ_ZERO;
+
+  if (pmm_init_stage != PMM_INIT_FULL) {
+    uint64_t val = alloc_buddy(req, num);
+    if (zero && val != ~0ULL)
+      zero_pages(val, num);
+    return val;
+  }
+
+  if (zero && num == 1) {
+    uint64_t val = zero_pool_take(req);
+    if (val != ~0ULL)
+      return val;
+  }
+
+  uint64_t val = (num == 1) ? pcp_alloc(req) : alloc_buddy(req, num);
+  if (val == ~0ULL) {
+    /* Pages cached in our magazines may be what's stopping a block from
+       coalescing, or the last free pages in the zone. */
+    drain_caches();
+    val = alloc_buddy(req, num);
+  }
+  while (val == ~0ULL && release_for(req))
+    val = alloc_buddy(req, num);
+
+  if (zero && val != ~0ULL)
+    zero_pages(val, num);
+  return val;
+}
+
+size_t alloc_pages_batch(int req, size_t num, size_t n, uint64_t *out) {
+  int zero = req & PAGE_REQ_ZERO;
+  req &= ~PAGE_REQ_ZERO;
+
+  size_t got = alloc_buddy_batch(req, num, n, out);
+  if (got < n && pmm_init_stage == PMM_INIT_FULL) {
+    drain_caches();
+    got += alloc_buddy_batch(req, num, n - got, &out[got]);
+    while (got < n && release_for(req))
+      got += alloc_buddy_batch(req, num, n - got, &out[got]);
+  }
+
+  for (size_t i = 0; zero && i < got; ++i)
+    zero_pages(out[i], num);
+  return got;
+}
+
+static uint64_t alloc_buddy_aligned(int req, size_t num, size_t align) {
+  spinlock_acquire(&lock);
+  uint64_t val = buddy_alloc_aligned(&allocators[req], num * get_page_size(),
+                                     align);
+
+  if (val == ~0ULL && req == PAGE_REQ_NONE)
+    val = buddy_alloc_aligned(&allocators[PAGE_REQ_UNDER4GB],
+                              num * get_page_size(), align);
+
+  spinlock_release(&lock);
+  return val;
+}
+
+uint64_t alloc_pages_aligned(int req, size_t num, size_t align) {
+  int zero = req & PAGE_REQ_ZERO;
+  req &= ~PAGE_REQ_ZERO;
+
+  uint64_t val = alloc_buddy_aligned(req, num, align);
+  if (val == ~0ULL && pmm_init_stage == PMM_INIT_FULL) {
+    drain_caches();
+    val = alloc_buddy_aligned(req, num, align);
+    while (val == ~0ULL && release_for(req))
+      val = alloc_buddy_aligned(req, num, align);
+  }
+
+  if (zero && val != ~0ULL)
+    zero_pages(val, num);
+  return val;
+}
+
 int free_page(uint64_t page) {
   return free_pages(page, 1);
 }
 
 int free_pages(uint64_t pages, size_t num) {
+  if (num == 1 && pmm_init_stage == PMM_INIT_FULL) {
+    if (zero_pool_refill(pages) == 0)
+      pcp_free(pages);
+    return 0;
+  }
+
   spinlock_acquire(&lock);
 
-  int req = PAGE_REQ_NONE;
-  if (pages < 0x100000)
-    req = PAGE_REQ_UNDER1MB;
-  else if (pages < 0x100000000ULL)
-    req = PAGE_REQ_UNDER4GB;
-  
-  buddy_free(&allocators[req], pages, num * get_page_size());
+  buddy_free(&allocators[zone_for(pages)], pages, num * get_page_size());
 
   spinlock_release(&lock);
   return 0;
@@ -115,6 +465,11 @@ int init_physical_memory() {
   assert(pmm_init_stage == PMM_INIT_EARLY &&
          "init_physical_memory_early must be called first!");
 
+  /* Don't manage memory that the VMM can't map. */
+  uint64_t limit = get_physical_address_limit();
+  if (early_max_extent > limit)
+    early_max_extent = limit;
+
   range_t rs[3];
   rs[PAGE_REQ_UNDER1MB].start = 0x0;
   rs[PAGE_REQ_UNDER1MB].extent = MAX(MIN(early_max_extent, 0x100000), 0);
@@ -154,6 +509,9 @@ int init_physical_memory() {
     return 1;
   }
 
+  uint64_t t = rdtsc();
+  uint64_t budget = PMM_BOOT_CHUNK;
+
   for (unsigned i = 0; i < early_nranges; ++i) {
     if (early_ranges[i].extent == 0)
       continue;
@@ -163,13 +521,24 @@ int init_physical_memory() {
       buddy_free_range(&allocators[PAGE_REQ_UNDER1MB], r);
 
     r = split_range(&early_ranges[i], 0x100000000ULL);
+    if (r.extent > 0) {
+      range_t now = split_range(&r, r.start + budget);
+      budget -= now.extent;
+      if (now.extent > 0)
+        buddy_free_range(&allocators[PAGE_REQ_UNDER4GB], now);
+      if (r.extent > 0)
+        defer_range(PAGE_REQ_UNDER4GB, r);
+    }
+
+    r = split_range(&early_ranges[i], limit);
     if (r.extent > 0)
-      buddy_free_range(&allocators[PAGE_REQ_UNDER4GB], r);
-
-    if (early_ranges[i].extent > 0)
-      buddy_free_range(&allocators[PAGE_REQ_NONE], early_ranges[i]);
+      defer_range(PAGE_REQ_NONE, r);
   }
 
+  kprintf("pmm: %dMB available at boot (%d cycles), %dMB deferred\n",
+          (int)((PMM_BOOT_CHUNK - budget) >> 20), (int)(rdtsc() - t),
+          (int)(deferred_bytes >> 20));
+
   pmm_init_stage = PMM_INIT_FULL;
 
   return 0;
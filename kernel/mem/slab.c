@@ -3,78 +3,80 @@
 #include "slab.h"
 #include "string.h"
 
+/* Objects are packed from the start of the slab and the footer sits at the
+   end. Free objects hold a pointer to the next free object in the slab, so
+   allocating and freeing never search. */
 typedef struct slab_footer {
-  struct slab_footer *next;
+  struct slab_footer *next, *prev;
+  void *free;     /* First free object, or NULL if the slab is full. */
+  unsigned nused;
 } slab_footer_t;
 
 #define SLAB_ADDR_MASK ~(SLAB_SIZE-1)
 #define FOOTER_FOR_PTR(x) (void*)(((uintptr_t) x & SLAB_ADDR_MASK) + SLAB_SIZE - sizeof(slab_footer_t))
 #define START_FOR_FOOTER(f) ((uintptr_t)f & SLAB_ADDR_MASK)
 
+/* Completely free slabs kept per cache before they are given back. */
+#define SLAB_MAX_EMPTY 1
+
 /* Internal functions */
 /* Destroy a slab, given its footer. */
 static void destroy(slab_cache_t *c, slab_footer_t *f);
 /* Create a new slab, in the given cache. */
 static slab_footer_t *create(slab_cache_t *c);
-/* Mark a slab entry as used - obj is a pointer relative to the start of the slab. */
-static void mark_used(slab_cache_t *c, slab_footer_t *f, void *obj);
-/* Mark a slab entry as unused - obj is a pointer relative to the start of the slab. */
-static void mark_unused(slab_cache_t *c, slab_footer_t *f, void *obj);
-/* Predicate: are all the entries in the given slab unused? */
-static int all_unused(slab_cache_t *c, slab_footer_t *f);
-/* Return the address of an empty object in the given slab, or NULL if all full. */
-static void *find_empty_obj(slab_cache_t *c, slab_footer_t *f);
+/* Destroy every slab on a list. */
+static void destroy_list(slab_cache_t *c, slab_footer_t *f);
+/* Add a slab to the front of a list. */
+static void push_slab(slab_footer_t **list, slab_footer_t *f);
+/* Take a slab off a list. */
+static void unlink_slab(slab_footer_t **list, slab_footer_t *f);
 
 int slab_cache_create(slab_cache_t *c, vmspace_t *vms, unsigned size, void *init) {
   c->size = size;
+  /* Free objects have to be able to hold the free list pointer. */
+  c->stride = (size < sizeof(void*)) ? sizeof(void*) : size;
   c->init = init;
-  c->first = NULL;
-  c->empty = NULL;
+  c->partial = c->full = c->empty = NULL;
+  c->nempty = 0;
   c->vms = vms;
   spinlock_init(&c->lock);
   return 0;
 }
 
 int slab_cache_destroy(slab_cache_t *c) {
-  slab_footer_t *s = c->first;
-  while (s) {
-    slab_footer_t *s_ = s->next;
-    destroy(c, s);
-    s = s_;
-  }
-  c->first = NULL;
+  destroy_list(c, c->partial);
+  destroy_list(c, c->full);
+  destroy_list(c, c->empty);
+  c->partial = c->full = c->empty = NULL;
+  c->nempty = 0;
   return 0;
 }
 
 void *slab_cache_alloc(slab_cache_t *c) {
   spinlock_acquire(&c->lock);
 
-  void *obj;
-  if (c->empty) {
-
-    obj = c->empty;
-    slab_footer_t *f = FOOTER_FOR_PTR(obj);
-    mark_used(c, f, obj);
-
-    while (f) {
-      c->empty = find_empty_obj(c, f);
-      if (c->empty) break;
-      f = f->next;
+  slab_footer_t *f = c->partial;
+  if (!f) {
+    /* Reuse a free slab if there is one, else make a new one. */
+    if (c->empty) {
+      f = c->empty;
+      unlink_slab(&c->empty, f);
+      --c->nempty;
+    } else {
+      f = create(c);
     }
+    push_slab(&c->partial, f);
+  }
 
-  } else {
-
-    /* No empty pointer - must create a new slab. */
-    slab_footer_t *f = c->first;
-    c->first = create(c);
-    c->first->next = f;
-    
-    obj = (void*)START_FOR_FOOTER(c->first);
-    mark_used(c, c->first, obj);
-
-    c->empty = find_empty_obj(c, c->first);
+  void *obj = f->free;
+  f->free = *(void**)obj;
+  ++f->nused;
 
+  if (!f->free) {
+    unlink_slab(&c->partial, f);
+    push_slab(&c->full, f);
   }
+
   if (c->init)
     memcpy(obj, c->init, c->size);
 
@@ -84,27 +86,27 @@ void *slab_cache_alloc(slab_cache_t *c) {
 
 void slab_cache_free(slab_cache_t *c, void *obj) {
   spinlock_acquire(&c->lock);
-  assert(c->first && "Trying to free from an empty cache!");
-  
+
   slab_footer_t *f = FOOTER_FOR_PTR(obj);
+  assert(f->nused > 0 && "Trying to free from an empty slab!");
 
-  mark_unused(c, f, obj);
+  if (!f->free) {
+    unlink_slab(&c->full, f);
+    push_slab(&c->partial, f);
+  }
 
-  if (!c->empty || c->empty > obj)
-    c->empty = obj;
+  *(void**)obj = f->free;
+  f->free = obj;
+  --f->nused;
 
-  if (!f->next && all_unused(c, f)) {
-    slab_footer_t *f2 = c->first;
-    if (f2 == f) {
-      c->first = NULL;
+  if (f->nused == 0) {
+    unlink_slab(&c->partial, f);
+    if (c->nempty < SLAB_MAX_EMPTY) {
+      push_slab(&c->empty, f);
+      ++c->nempty;
     } else {
-      while (f2->next != f)
-        f2 = f2->next;
-      f2->next = NULL;
+      destroy(c, f);
     }
-    if (FOOTER_FOR_PTR(c->empty) == f)
-      c->empty = NULL;
-    destroy(c, f);
   }
   spinlock_release(&c->lock);
 }
@@ -113,84 +115,61 @@ static void destroy(slab_cache_t *c, slab_footer_t *f) {
   vmspace_free(c->vms, SLAB_SIZE, START_FOR_FOOTER(f), /*free_phys=*/1);
 }
 
-/* Return the number of entries in a bitmap for an object of 'obj_sz'. */
-static inline unsigned bitmap_num(int obj_sz) {
-  unsigned avail = SLAB_SIZE - sizeof(slab_footer_t);
-  return avail / obj_sz;
-}
-
-/* Return the size in bytes of a bitmap for an object of 'obj_sz'. */
-static inline unsigned bitmap_sz(int obj_sz) {
-  return bitmap_num(obj_sz) / 8 + 1;
+static void destroy_list(slab_cache_t *c, slab_footer_t *f) {
+  while (f) {
+    slab_footer_t *f_ = f->next;
+    destroy(c, f);
+    f = f_;
+  }
 }
 
-/* Return the bitmap entry index that represents 'obj'. */
-static inline unsigned bitmap_idx(slab_footer_t *f, void *obj, int obj_sz) {
-  return ( (uintptr_t)obj - START_FOR_FOOTER(f) ) / obj_sz;
+/* Return the number of objects of 'obj_sz' that fit before the footer. */
+static inline unsigned objs_per_slab(unsigned obj_sz) {
+  return (SLAB_SIZE - sizeof(slab_footer_t)) / obj_sz;
 }
 
 static slab_footer_t *create(slab_cache_t *c) {
   uintptr_t addr = vmspace_alloc(c->vms, SLAB_SIZE, /*alloc_phys=*/PAGE_WRITE);
 
+  /* Record which cache the slab's frames belong to. PF_HEAD and the order
+     stay, so vmspace_free() can still free the slab as one block. */
+  for (unsigned i = 0; i < SLAB_SIZE; i += get_page_size()) {
+    page_frame_t *pf = get_page_frame(get_mapping(addr + i, NULL));
+    pf->u.owner = c;
+    pf->flags = (pf->flags & ~PF_VMSPACE) | PF_SLAB;
+  }
+
   slab_footer_t *f = FOOTER_FOR_PTR(addr);
-  f->next = NULL;
-  
-  /* Initialise the used/free bitmap. */
-  uintptr_t bm = (uintptr_t)f - bitmap_sz(c->size);
-  memset((uint8_t*)bm, 0, bitmap_sz(c->size));
+  f->next = f->prev = NULL;
+  f->nused = 0;
+
+  /* Thread every object onto the free list, lowest address first. */
+  unsigned n = objs_per_slab(c->stride);
+  void *next = NULL;
+  for (unsigned i = n; i > 0; --i) {
+    void *obj = (void*)(addr + (i - 1) * c->stride);
+    *(void**)obj = next;
+    next = obj;
+  }
+  f->free = next;
 
   return f;
 }
 
-static void mark_used(slab_cache_t *c, slab_footer_t *f, void *obj) {
-  unsigned idx = bitmap_idx(f, obj, c->size);
-  unsigned sz = bitmap_sz(c->size);
-
-  unsigned byte = idx >> 3;
-  unsigned bit = idx & 7;
-  uint8_t *ptr = (uint8_t*)f - sz + byte;
-  *ptr |= 1 << bit;
-}
-
-static void mark_unused(slab_cache_t *c, slab_footer_t *f, void *obj) {
-  unsigned idx = bitmap_idx(f, obj, c->size);
-  unsigned sz = bitmap_sz(c->size);
-
-  unsigned byte = idx >> 3;
-  unsigned bit = idx & 7;
-  uint8_t *ptr = (uint8_t*)f - sz + byte;
-  *ptr &= ~(1 << bit);
-}
-
-static int all_unused(slab_cache_t *c, slab_footer_t *f) {
-  unsigned sz = bitmap_sz(c->size);
-  uint8_t *p = (uint8_t*)f - sz;
-
-  /* FIXME: Use something fast like memcmp? */
-  for (unsigned i = 0; i < sz; ++i)
-    if (*p++ != 0) return 0;
-  return 1;
-}
-
-static int lsb_clear(uint8_t byte) {
-  int i = 0;
-  while ((byte & 1) == 1) {
-    ++i;
-    byte >>= 1;
-  }
-  return i;
+static void push_slab(slab_footer_t **list, slab_footer_t *f) {
+  f->prev = NULL;
+  f->next = *list;
+  if (*list)
+    (*list)->prev = f;
+  *list = f;
 }
 
-static void *find_empty_obj(slab_cache_t *c, slab_footer_t *f) {
-  unsigned sz = bitmap_sz(c->size);
-  uint8_t *p = (uint8_t*)f - sz;
-
-  for (unsigned i = 0; i < sz; ++i) {
-    if (*p != 0xFF) {
-      unsigned idx = i * 8 + lsb_clear(*p);
-      return (idx >= bitmap_num(c->size)) ? NULL : (void*)(START_FOR_FOOTER(f) + c->size*idx);
-    }
-    ++p;
-  }
-  return NULL;
+static void unlink_slab(slab_footer_t **list, slab_footer_t *f) {
+  if (f->prev)
+    f->prev->next = f->next;
+  else
+    *list = f->next;
+  if (f->next)
+    f->next->prev = f->prev;
+  f->next = f->prev = NULL;
 }
@@ -9,7 +9,24 @@
 
 static address_space_t *current = NULL;
 
-static spinlock_t global_vmm_lock = SPINLOCK_RELEASED;
+/* Nonzero if we switched to PAE paging at boot: three levels, 64-bit
+   entries, and physical addresses above 4GB. Otherwise we use classic
+   two-level paging with 32-bit entries. */
+static int pae = 0;
+
+/* Nonzero if CR4.PSE is on, so legacy directory entries can map 4MB pages.
+   PAE directory entries can always map 2MB pages. */
+static int pse = 0;
+
+/* Nonzero if CR4.PGE is on. Kernel mappings are then marked global, as
+   they are the same in every address space, and survive CR3 writes. */
+static int pge = 0;
+
+/* Every address space, so that changes to kernel directory entries can be
+   copied into all of them. Taken after a kernel region's lock, and before
+   a user region's. */
+static address_space_t *address_spaces = NULL;
+static spinlock_t as_list_lock = SPINLOCK_RELEASED;
 
 static int from_x86_flags(int flags) {
   int f = 0;
@@ -32,13 +49,30 @@ address_space_t *get_current_address_space() {
   return current;
 }
 
+static void sync_all_from_ref(address_space_t *as);
+
 int switch_address_space(address_space_t *dest) {
-  write_cr3((uintptr_t)dest->directory | X86_PRESENT | X86_WRITE);
+  /* Kernel entries are normally copied in on demand, but this CPU's stack
+     may be in a kernel table that 'dest' hasn't picked up yet, and a fault
+     on the stack can't be handled. */
+  sync_all_from_ref(dest);
+
+  current = dest;
+  if (pae)
+    /* In PAE mode CR3 holds the PDPT address; the low bits are not flags. */
+    write_cr3((uintptr_t)dest->directory);
+  else
+    write_cr3((uintptr_t)dest->directory | X86_PRESENT | X86_WRITE);
   return 0;
 }
 
+uint64_t get_physical_address_limit() {
+  /* PAE supports more on newer processors, but the page frame database
+     window is sized for 36 bits. */
+  return pae ? (1ULL << 36) : (1ULL << 32);
+}
+
 #define RPDT_BASE  1023
-#define RPDT_BASE2 1022
 
 #define PAGE_SIZE 4096U
 #define PAGE_TABLE_SIZE (PAGE_SIZE * 1024U)
@@ -48,100 +82,924 @@ int switch_address_space(address_space_t *dest) {
                                             RPDT_BASE*PAGE_SIZE + \
                                             ((v)>>22) * 4)
 
+/** With PAE, the four page directories are mapped into the last four entries of the last one. The page tables then appear as one 8MB array of 64-bit entries at 0xFF800000, and the directories as 2048 entries at 0xFFFFC000. { */
+
+#define PAE_PTE_BASE 0xFF800000U
+#define PAE_PDE_BASE 0xFFFFC000U
+#define PAE_TABLE_SIZE (PAGE_SIZE * 512U)
+#define PAE_PTE(v) (volatile uint32_t*)(PAE_PTE_BASE + ((v)>>12) * 8)
+#define PAE_PDE(v) (volatile uint32_t*)(PAE_PDE_BASE + ((v)>>21) * 8)
+
+#define PAE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+/** } */
+
+/* Store a 64-bit entry with two 32-bit writes, ordered so that the
+   processor never sees the present bit with half an address. */
+static void write_entry64(volatile uint32_t *e, uint64_t val) {
+  if (val & X86_PRESENT) {
+    e[1] = val >> 32;
+    e[0] = (uint32_t)val;
+  } else {
+    e[0] = (uint32_t)val;
+    e[1] = val >> 32;
+  }
+}
+
+static uint64_t read_entry64(volatile uint32_t *e) {
+  return ((uint64_t)e[1] << 32) | e[0];
+}
+
+/** Everything else goes through these accessors, so only they need to know which format is in use. { */
+
+static uint64_t get_pde(uintptr_t v) {
+  return pae ? read_entry64(PAE_PDE(v)) : *PAGE_DIR_ENTRY(RPDT_BASE, v);
+}
+
+static void set_pde(uintptr_t v, uint64_t e) {
+  if (pae)
+    write_entry64(PAE_PDE(v), e);
+  else
+    *PAGE_DIR_ENTRY(RPDT_BASE, v) = (uint32_t)e;
+}
+
+static uint64_t get_pte(uintptr_t v) {
+  return pae ? read_entry64(PAE_PTE(v)) : *PAGE_TABLE_ENTRY(RPDT_BASE, v);
+}
+
+static void set_pte(uintptr_t v, uint64_t e) {
+  if (pae)
+    write_entry64(PAE_PTE(v), e);
+  else
+    *PAGE_TABLE_ENTRY(RPDT_BASE, v) = (uint32_t)e;
+}
+
+static uint64_t entry_addr(uint64_t e) {
+  return e & (pae ? PAE_ADDR_MASK : 0xFFFFF000ULL);
+}
+
+static unsigned large_page_size() {
+  return pae ? PAE_TABLE_SIZE : (pse ? PAGE_TABLE_SIZE : 0);
+}
+
+static int is_large(uint64_t pde) {
+  return (pde & (X86_PRESENT | X86_PS)) == (X86_PRESENT | X86_PS);
+}
+
+/* The address of the large page a directory entry maps. Bit 12 and up is
+   PAT and reserved bits in the low part of the field. */
+static uint64_t large_addr(uint64_t pde) {
+  return pde & (pae ? PAE_ADDR_MASK & ~(uint64_t)(PAE_TABLE_SIZE - 1) :
+                0xFFC00000ULL);
+}
+
+/** } */
+
+static void invlpg(uintptr_t v) {
+  uintptr_t *pv = (uintptr_t*)v;
+  __asm__ volatile("invlpg %0" : : "m" (*pv));
+}
+
+/* Map physical page 'p' at scratch slot 'slot' (0..MMAP_SCRATCH_SLOTS-1),
+   returning its address. Only used while switching to PAE at boot; after
+   that, use kmap_atomic(). */
+static void *map_scratch(unsigned slot, uint64_t p) {
+  uintptr_t v = MMAP_SCRATCH + slot * PAGE_SIZE;
+  set_pte(v, p | X86_PRESENT | X86_WRITE);
+  invlpg(v);
+  return (void*)v;
+}
+
+static void unmap_scratch(unsigned slot) {
+  uintptr_t v = MMAP_SCRATCH + slot * PAGE_SIZE;
+  set_pte(v, 0);
+  invlpg(v);
+}
+
+/** kmap_atomic() slots are per core and used as a stack, so they need no lock; turning interrupts off keeps anything else on this core from using them meanwhile. kunmap_atomic() leaves the stale entry in place, as the next kmap_atomic() of that slot overwrites and flushes it. { */
+
+typedef struct kmap_state {
+  unsigned depth;
+  int ints[MMAP_KMAP_SLOTS];
+} kmap_state_t;
+
+static kmap_state_t kmaps[MAX_CORES];
+
+static kmap_state_t *get_kmap_state(int *id) {
+  *id = get_processor_id();
+  if (*id == -1)
+    *id = 0;
+  return &kmaps[*id];
+}
+
+void *kmap_atomic(uint64_t p) {
+  int ints = get_interrupt_state();
+  disable_interrupts();
+
+  int id;
+  kmap_state_t *k = get_kmap_state(&id);
+  if (k->depth == MMAP_KMAP_SLOTS)
+    panic("kmap_atomic: out of slots!");
+  k->ints[k->depth] = ints;
+
+  uintptr_t v = MMAP_KMAP + (id * MMAP_KMAP_SLOTS + k->depth++) * PAGE_SIZE;
+  set_pte(v, (p & ~(uint64_t)0xFFF) | X86_PRESENT | X86_WRITE);
+  invlpg(v);
+  return (void*)v;
+}
+
+void kunmap_atomic(void *v) {
+  int id;
+  kmap_state_t *k = get_kmap_state(&id);
+  if (k->depth == 0 || (uintptr_t)v != MMAP_KMAP +
+      (id * MMAP_KMAP_SLOTS + k->depth - 1) * PAGE_SIZE)
+    panic("kunmap_atomic: not the most recent mapping!");
+
+  set_interrupt_state(k->ints[--k->depth]);
+}
+
+/** } */
+
+/* Flush after the directory entry for 'v' changed. That covers the
+   recursive mapping of its table as well as 'v' itself. */
+static void invlpg_pde(uintptr_t v) {
+  invlpg(v);
+  invlpg(pae ? (uintptr_t)PAE_PTE(v) :
+         (uintptr_t)PAGE_TABLE_ENTRY(RPDT_BASE, v));
+}
+
+/* Flush every TLB entry, including global ones, which a CR3 write
+   leaves alone. Toggling CR4.PGE does it. */
+static void flush_tlb_all() {
+  if (pge) {
+    unsigned cr4 = read_cr4();
+    write_cr4(cr4 & ~CR4_PGE);
+    write_cr4(cr4);
+  } else {
+    write_cr3(read_cr3());
+  }
+}
+
+/** The boot address space's directory is the reference copy of kernel space. Kernel page tables are only created when first needed, and go into the reference directory; other address spaces copy the entry over when they first fault on it (or look it up). A kernel entry that changes or goes away, as with large pages, has to be pushed out to every address space at once, since a stale copy would still work.
+
+    as_list_lock serialises changes to the reference entries and to the list of address spaces. The page fault handler must never take it, as this CPU may fault while holding it (on an address space object that isn't synced yet, say), so copying a reference entry in is done without it. { */
+
+static address_space_t *kernel_ref = NULL;
+/* The physical directory holding the reference kernel entries: the whole
+   directory, or the last of the four with PAE. */
+static uint64_t kernel_ref_dir;
+
+static unsigned kernel_pde_index(uintptr_t v) {
+  return pae ? (v >> 21) & 511 : v >> 22;
+}
+
+static uint64_t get_ref_pde(uintptr_t v) {
+  if (current == kernel_ref)
+    return get_pde(v);
+  void *d = kmap_atomic(kernel_ref_dir);
+  uint64_t e = pae ? ((uint64_t*)d)[kernel_pde_index(v)] :
+    ((uint32_t*)d)[kernel_pde_index(v)];
+  kunmap_atomic(d);
+  return e;
+}
+
+static void set_ref_pde(uintptr_t v, uint64_t e) {
+  if (current == kernel_ref) {
+    set_pde(v, e);
+    return;
+  }
+  void *d = kmap_atomic(kernel_ref_dir);
+  if (pae)
+    write_entry64((uint32_t*)&((uint64_t*)d)[kernel_pde_index(v)], e);
+  else
+    ((uint32_t*)d)[kernel_pde_index(v)] = (uint32_t)e;
+  kunmap_atomic(d);
+}
+
+static int as_list_lock_acquire() {
+  int ints = get_interrupt_state();
+  disable_interrupts();
+  spinlock_acquire(&as_list_lock);
+  return ints;
+}
+
+static void as_list_lock_release(int ints) {
+  spinlock_release(&as_list_lock);
+  set_interrupt_state(ints);
+}
+
+/* Changes to the mappings in one page table's worth of address space, and
+   to the directory entry for it, happen under that region's lock. Regions
+   hash onto a fixed set of locks, so work in different regions rarely
+   waits. They are taken with interrupts off, as the page fault handler
+   takes them too.
+
+   A kernel region's lock is taken before as_list_lock, and a user
+   region's after it (by clone_address_space()), so the two kinds hash
+   onto separate halves of the set. */
+#define REGION_LOCKS 64
+
+static spinlock_t region_locks[REGION_LOCKS];
+
+static spinlock_t *region_lock(uintptr_t v) {
+  unsigned i = v / (pae ? PAE_TABLE_SIZE : PAGE_TABLE_SIZE);
+  return &region_locks[i % (REGION_LOCKS / 2) +
+                       (IS_KERNEL_ADDR(v) ? REGION_LOCKS / 2 : 0)];
+}
+
+static int region_lock_acquire(uintptr_t v) {
+  int ints = get_interrupt_state();
+  disable_interrupts();
+  spinlock_acquire(region_lock(v));
+  return ints;
+}
+
+static void region_lock_release(uintptr_t v, int ints) {
+  spinlock_release(region_lock(v));
+  set_interrupt_state(ints);
+}
+
+/* Copy the reference entry for kernel address 'v' into the current
+   directory if it is missing there. Returns 1 if it did.
+
+   This takes no lock. A present reference entry only changes through
+   sync_kernel_pde(), which updates the reference before writing the new
+   entry into every directory. So if the reference has not changed since
+   this copied it, the copy is current; if it has, copying again catches
+   up with the push. */
+static int sync_from_ref(uintptr_t v) {
+  if (!IS_KERNEL_ADDR(v) || v >= MMAP_KERNEL_END || current == kernel_ref ||
+      (get_pde(v) & X86_PRESENT))
+    return 0;
+
+  uint64_t e = get_ref_pde(v);
+  if ((e & X86_PRESENT) == 0)
+    return 0;
+
+  for (;;) {
+    set_pde(v, e);
+    __sync_synchronize();
+    uint64_t r = get_ref_pde(v);
+    if (r == e)
+      break;
+    e = r;
+  }
+  return (e & X86_PRESENT) != 0;
+}
+
+static uint64_t dir_entry(void *d, unsigned i) {
+  return pae ? ((volatile uint64_t*)d)[i] : ((volatile uint32_t*)d)[i];
+}
+
+/* Copy every reference kernel entry missing from the directory of 'as'
+   into it, on the same terms as sync_from_ref(). */
+static void sync_all_from_ref(address_space_t *as) {
+  if (as == kernel_ref)
+    return;
+
+  uint64_t dir = (uintptr_t)as->directory;
+  if (pae) {
+    uint64_t *pdpt = kmap_atomic(dir);
+    dir = pdpt[3] & PAE_ADDR_MASK;
+    kunmap_atomic(pdpt);
+  }
+
+  void *d = kmap_atomic(dir);
+  void *ref = kmap_atomic(kernel_ref_dir);
+  for (unsigned i = kernel_pde_index(MMAP_KERNEL_START);
+       i < kernel_pde_index(MMAP_KERNEL_END); ++i) {
+    uint64_t e = dir_entry(ref, i);
+    if ((dir_entry(d, i) & X86_PRESENT) || (e & X86_PRESENT) == 0)
+      continue;
+
+    for (;;) {
+      if (pae)
+        write_entry64((uint32_t*)&((uint64_t*)d)[i], e);
+      else
+        ((volatile uint32_t*)d)[i] = (uint32_t)e;
+      __sync_synchronize();
+      uint64_t r = dir_entry(ref, i);
+      if (r == e)
+        break;
+      e = r;
+    }
+  }
+  kunmap_atomic(ref);
+  kunmap_atomic(d);
+}
+
+/* Publish a change to the kernel directory entry for 'v', which used to be
+   'old'. Called with the region lock held. */
+static void sync_kernel_pde(uintptr_t v, uint64_t old) {
+  if (!IS_KERNEL_ADDR(v))
+    return;
+
+  uint64_t e = get_pde(v);
+
+  int ints = as_list_lock_acquire();
+  /* The reference goes first; sync_from_ref() relies on it. */
+  set_ref_pde(v, e);
+  if ((old & X86_PRESENT) == 0) {
+    /* New: others pick it up on demand. */
+    as_list_lock_release(ints);
+    return;
+  }
+
+  for (address_space_t *as = address_spaces; as; as = as->next) {
+    if (as->directory == current->directory)
+      continue;
+
+    if (pae) {
+      uint64_t *pdpt = kmap_atomic((uintptr_t)as->directory);
+      uint64_t pd = pdpt[v >> 30] & PAE_ADDR_MASK;
+      kunmap_atomic(pdpt);
+      uint64_t *d = kmap_atomic(pd);
+      write_entry64((uint32_t*)&d[(v >> 21) & 511], e);
+      kunmap_atomic(d);
+    } else {
+      uint32_t *d = kmap_atomic((uintptr_t)as->directory);
+      d[v >> 22] = (uint32_t)e;
+      kunmap_atomic(d);
+    }
+  }
+  as_list_lock_release(ints);
+}
+
+/** } */
+
+/** Every user page table counts its nonzero entries in its frame's ``u.nused``, and unmap() frees a table once the count drops to zero. Freed tables are all zeroes, so a few are kept to be handed out again without clearing another page. { */
+
+#define TABLE_CACHE_MAX 16
+
+static uint64_t table_cache[TABLE_CACHE_MAX];
+static unsigned table_cache_n = 0;
+static spinlock_t table_cache_lock = SPINLOCK_RELEASED;
+
+/* Get a zeroed page for a page table. This doesn't touch the frame
+   database, as kernel tables are made before it exists. */
+static uint64_t alloc_table() {
+  uint64_t p = ~0ULL;
+
+  int ints = get_interrupt_state();
+  disable_interrupts();
+  spinlock_acquire(&table_cache_lock);
+  if (table_cache_n > 0)
+    p = table_cache[--table_cache_n];
+  spinlock_release(&table_cache_lock);
+  set_interrupt_state(ints);
+
+  if (p == ~0ULL)
+    /* Only PAE can point at a table above 4GB. */
+    p = alloc_page((pae ? PAGE_REQ_NONE : PAGE_REQ_UNDER4GB) | PAGE_REQ_ZERO);
+  if (p == ~0ULL)
+    panic("alloc_page failed allocating a page table!");
+  return p;
+}
+
+/* Give back a page table whose entries are all zero. */
+static void free_zeroed_table(uint64_t p) {
+  int cached = 0;
+
+  int ints = get_interrupt_state();
+  disable_interrupts();
+  spinlock_acquire(&table_cache_lock);
+  if (table_cache_n < TABLE_CACHE_MAX) {
+    table_cache[table_cache_n++] = p;
+    cached = 1;
+  }
+  spinlock_release(&table_cache_lock);
+  set_interrupt_state(ints);
+
+  if (!cached)
+    free_page(p);
+}
+
+/* Mark the page at 'p' as a user page table with 'nused' entries. */
+static void set_table_frame(uint64_t p, unsigned nused) {
+  page_frame_t *pf = get_page_frame(p);
+  pf->flags = PF_TABLE;
+  pf->refcnt = 0;
+  pf->u.nused = nused;
+}
+
+/* The frame of the user page table covering 'v', or NULL if it isn't
+   counted: kernel tables live as long as the reference directory. */
+static page_frame_t *table_frame(uintptr_t v) {
+  if (IS_KERNEL_ADDR(v))
+    return NULL;
+  page_frame_t *pf = get_page_frame(entry_addr(get_pde(v)));
+  return (pf->flags & PF_TABLE) ? pf : NULL;
+}
+
+/* set_pte(), keeping the table's count up to date. Called with the
+   region lock held. */
+static void set_pte_counted(uintptr_t v, uint64_t e) {
+  page_frame_t *pf = table_frame(v);
+  if (pf) {
+    uint64_t old = get_pte(v);
+    if (old == 0 && e != 0)
+      ++pf->u.nused;
+    else if (old != 0 && e == 0)
+      --pf->u.nused;
+  }
+  set_pte(v, e);
+}
+
+/* Free the user page table covering 'v' if nothing is left in it. Called
+   with the region lock held. */
+static void reclaim_table(uintptr_t v) {
+  page_frame_t *pf = table_frame(v);
+  if (!pf || pf->u.nused != 0)
+    return;
+
+  uint64_t t = entry_addr(get_pde(v));
+  set_pde(v, 0);
+  invlpg_pde(v);
+  pf->flags = 0;
+  free_zeroed_table(t);
+}
+
+/** } */
+
+/** Page tables in user space are shared between address spaces by clone_address_space(): both directory entries point at the same table, read-only and marked X86_SHARED, and the table's frame counts the directories using it. The first write to the region, or any change to its mappings, gives that address space a copy. { */
+
+/* Guards the sharing counts of page tables. Taken after a region lock,
+   with interrupts off. */
+static spinlock_t table_lock = SPINLOCK_RELEASED;
+
+/* Copy the page table at physical 'src' into 'dst'. If 'make_cow',
+   writable pages become copy-on-write in both. Returns the number of
+   nonzero entries. Called with table_lock held. */
+static unsigned copy_table(uint64_t src, uint64_t dst, int make_cow) {
+  void *s = kmap_atomic(src), *d = kmap_atomic(dst);
+
+  unsigned n = pae ? 512 : 1024, nused = 0;
+  for (unsigned j = 0; j < n; ++j) {
+    uint64_t pte = pae ? ((uint64_t*)s)[j] : ((uint32_t*)s)[j];
+
+    /* If the page is writable, make it copy-on-write. */
+    if (make_cow && (pte & X86_PRESENT) && (pte & X86_WRITE)) {
+      pte = (pte & ~(uint64_t)X86_WRITE) | X86_COW;
+      cow_refcnt_inc(entry_addr(pte));
+      if (pae)
+        write_entry64((uint32_t*)&((uint64_t*)s)[j], pte);
+      else
+        ((uint32_t*)s)[j] = (uint32_t)pte;
+    }
+    if (pte & X86_COW)
+      /* One more mapping shares the page. */
+      cow_refcnt_inc(entry_addr(pte));
+    if (pte)
+      ++nused;
+
+    if (pae)
+      ((uint64_t*)d)[j] = pte;
+    else
+      ((uint32_t*)d)[j] = (uint32_t)pte;
+  }
+
+  kunmap_atomic(d);
+  kunmap_atomic(s);
+  return nused;
+}
+
+/* Give the current address space its own copy of the table covering 'v'
+   if it is shared. Called with the region lock held. */
+static void unshare_table(uintptr_t v) {
+  uint64_t pde = get_pde(v);
+  if ((pde & (X86_PRESENT | X86_SHARED)) != (X86_PRESENT | X86_SHARED))
+    return;
+
+  uint64_t t = entry_addr(pde);
+  page_frame_t *pf = get_page_frame(t);
+
+  int ints = get_interrupt_state();
+  disable_interrupts();
+  spinlock_acquire(&table_lock);
+
+  if (pf->refcnt > 1) {
+    --pf->refcnt;
+    uint64_t p = alloc_table();
+    set_table_frame(p, copy_table(t, p, /*make_cow=*/1));
+    t = p;
+  } else {
+    /* Everyone else has taken their own copy; this one is ours. */
+    pf->refcnt = 0;
+  }
+
+  spinlock_release(&table_lock);
+  set_interrupt_state(ints);
+
+  set_pde(v, t | (pde & 0xFFF & ~(uint64_t)X86_SHARED) | X86_WRITE);
+  /* Any page in the region may have changed. Kernel pages are global, so
+     this only flushes user space if PGE is on. */
+  write_cr3(read_cr3());
+}
+
+/* Share the table covering 'v' with a new directory, returning the entry
+   for it. Called with the region lock held. */
+static uint64_t share_table(uintptr_t v) {
+  uint64_t pde = get_pde(v);
+  page_frame_t *pf = get_page_frame(entry_addr(pde));
+
+  int ints = get_interrupt_state();
+  disable_interrupts();
+  spinlock_acquire(&table_lock);
+
+  if ((pde & X86_SHARED) == 0) {
+    pf->refcnt = 1;
+    pde = (pde & ~(uint64_t)X86_WRITE) | X86_SHARED;
+    set_pde(v, pde);
+  }
+  ++pf->refcnt;
+
+  spinlock_release(&table_lock);
+  set_interrupt_state(ints);
+  return pde;
+}
+
+/** } */
+
+/* Kernel tables are created in the reference directory, with the lock
+   held so that two address spaces can't both make one. */
+static void ensure_kernel_table(uintptr_t v) {
+  int ints = as_list_lock_acquire();
+
+  uint64_t e = get_ref_pde(v);
+  if ((e & X86_PRESENT) == 0) {
+    e = alloc_table() | X86_PRESENT | X86_WRITE;
+    set_ref_pde(v, e);
+  }
+  set_pde(v, e);
+
+  as_list_lock_release(ints);
+}
+
 static void ensure_page_table_mapped(uintptr_t v) {
-  if (((*PAGE_DIR_ENTRY(RPDT_BASE, v)) & X86_PRESENT) == 0) {
-    dbg("ensure_page_table_mapped: alloc_page!\n");
-    uint64_t p = alloc_page(PAGE_REQ_UNDER4GB);
-    dbg("alloc_page finished!\n");
-    if (p == ~0ULL)
-      panic("alloc_page failed in map()!");
+  if ((get_pde(v) & X86_PRESENT) == 0 && IS_KERNEL_ADDR(v)) {
+    ensure_kernel_table(v);
+  } else if ((get_pde(v) & X86_PRESENT) == 0) {
+    uint64_t p = alloc_table();
+    set_table_frame(p, 0);
+    set_pde(v, p | X86_PRESENT | X86_WRITE | X86_USER);
+  }
+}
+
+/* zero_page() is called from alloc_page(), which map() itself calls with
+   a region lock held, so it mustn't take one; kmap_atomic() needs none. */
+void zero_page(uint64_t p) {
+  void *v = kmap_atomic(p);
+  memset(v, 0, PAGE_SIZE);
+  kunmap_atomic(v);
+}
+
+/* Above this many pages, unmap() reloads CR3 rather than issuing an
+   invlpg for each one. */
+#define INVLPG_MAX 32
+
+/* The number of the 'num' pages starting at 'v' that share its page
+   table. */
+static unsigned pages_in_table(uintptr_t v, unsigned num) {
+  unsigned tsz = pae ? PAE_TABLE_SIZE : PAGE_TABLE_SIZE;
+  unsigned left = (tsz - (v & (tsz - 1))) / PAGE_SIZE;
+  return num < left ? num : left;
+}
 
-    *PAGE_DIR_ENTRY(RPDT_BASE, v) = p | X86_PRESENT | X86_WRITE | X86_USER;
+/* Map one large page with a single directory entry. Fails if the region
+   already has a page table with anything in it; an empty one is freed.
+   Called with the region lock held. */
+static int map_large(uintptr_t v, uint64_t p, uint64_t x86_flags) {
+  sync_from_ref(v);
+  uint64_t pde = get_pde(v);
+  if (is_large(pde))
+    panic("Tried to map a large page that was already mapped!");
+  if (pde & X86_SHARED)
+    return -1;
 
-    /* Ensure that the new table is set to zero first! */
-    v = (v >> 22) << 22; /* Clear the lower 22 bits. */
-    
-    memset(PAGE_TABLE_ENTRY(RPDT_BASE, v), 0, 0x1000);
+  if (pde & X86_PRESENT) {
+    unsigned n = large_page_size() / PAGE_SIZE;
+    for (unsigned j = 0; j < n; ++j)
+      if (get_pte(v + j * PAGE_SIZE) != 0)
+        return -1;
   }
+
+  set_pde(v, p | x86_flags | X86_PS);
+  invlpg_pde(v);
+  sync_kernel_pde(v, pde);
+
+  if (pde & X86_PRESENT) {
+    /* The table was empty. */
+    if (!IS_KERNEL_ADDR(v))
+      get_page_frame(entry_addr(pde))->flags = 0;
+    free_zeroed_table(entry_addr(pde));
+  }
+  return 0;
 }
 
-static int map_one_page(uintptr_t v, uint64_t p, unsigned flags) {
-  dbg("map: getting lock...\n");
-  spinlock_acquire(&current->lock);
-  dbg("map: %x -> %x (flags %x)\n", v, (uint32_t)p, flags);
+/** map() and unmap() take the lock once for the whole range, look at each directory entry once, and then run through the entries of its table. { */
+
+int map(uintptr_t v, uint64_t p, int num_pages, unsigned flags) {
+  /* Without PAE, entries only have room for 32-bit physical addresses. */
+  if (p + (uint64_t)num_pages * PAGE_SIZE > get_physical_address_limit())
+    return -1;
+
   /* Quick sanity check - a page with CoW must not be writable. */
-  if (flags & PAGE_COW) {
-    cow_refcnt_inc(p);
+  if (flags & PAGE_COW)
     flags &= ~PAGE_WRITE;
+  uint64_t x86_flags = to_x86_flags(flags) | X86_PRESENT;
+
+  /* Use a large page wherever both addresses are aligned to one and the
+     run covers it. Copy-on-write is tracked per 4KB page, so never for
+     those. */
+  unsigned lsz = large_page_size(), lpages = lsz / PAGE_SIZE;
+
+  for (int i = 0; i < num_pages; ) {
+    uintptr_t vi = v + i * PAGE_SIZE;
+    uint64_t pi = (p & ~(uint64_t)0xFFF) + (uint64_t)i * PAGE_SIZE;
+    uint64_t f = (pge && IS_KERNEL_ADDR(vi)) ? x86_flags | X86_GLOBAL :
+      x86_flags;
+
+    uintptr_t r = vi;
+    int ints = region_lock_acquire(r);
+
+    if (lsz && (unsigned)(num_pages - i) >= lpages &&
+        (vi & (lsz - 1)) == 0 && (pi & (lsz - 1)) == 0 &&
+        (flags & PAGE_COW) == 0 && map_large(vi, pi, f) == 0) {
+      region_lock_release(r, ints);
+      i += lpages;
+      continue;
+    }
+
+    ensure_page_table_mapped(vi);
+    unshare_table(vi);
+    if (is_large(get_pde(vi))) {
+      kprintf("*** mapping %x to %x with flags %x\n", vi, (uint32_t)pi, flags);
+      panic("Tried to map a page inside a large page!");
+    }
+
+    unsigned n = pages_in_table(vi, num_pages - i);
+    for (unsigned j = 0; j < n; ++j, vi += PAGE_SIZE, pi += PAGE_SIZE) {
+      if (get_pte(vi) & X86_PRESENT) {
+        kprintf("*** mapping %x to %x with flags %x\n", vi, (uint32_t)pi, flags);
+        panic("Tried to map a page that was already mapped!");
+      }
+      if (flags & PAGE_COW)
+        cow_refcnt_inc(pi);
+      set_pte_counted(vi, pi | f);
+    }
+    region_lock_release(r, ints);
+    i += n;
   }
 
-  ensure_page_table_mapped(v);
-  dbg("map: Made sure page table was mapped.\n");
+  return 0;
+}
+
+/* Replace the large page covering 'v' with a page table mapping the same
+   memory in 4KB pages. Called with the region lock held. */
+static void split_large_page(uintptr_t v) {
+  uint64_t pde = get_pde(v), base = large_addr(pde);
+  /* Bit 7 means PAT rather than PS in a table entry. */
+  uint64_t flags = pde & 0xFFF & ~(uint64_t)X86_PS;
+
+  /* Every entry is written, so there's no need for a zeroed page. */
+  uint64_t p = alloc_page(pae ? PAGE_REQ_NONE : PAGE_REQ_UNDER4GB);
+  if (p == ~0ULL)
+    panic("alloc_page failed splitting a large page!");
+
+  void *t = kmap_atomic(p);
+  unsigned n = large_page_size() / PAGE_SIZE;
+  for (unsigned j = 0; j < n; ++j) {
+    uint64_t e = (base + j * PAGE_SIZE) | flags;
+    if (pae)
+      ((uint64_t*)t)[j] = e;
+    else
+      ((uint32_t*)t)[j] = (uint32_t)e;
+  }
+  kunmap_atomic(t);
+
+  /* Kernel directory entries are never user accessible. */
+  uint64_t e = p | X86_PRESENT | X86_WRITE;
+  if (!IS_KERNEL_ADDR(v)) {
+    set_table_frame(p, n);
+    e |= X86_USER;
+  }
+
+  set_pde(v, e);
+  invlpg_pde(v);
+  sync_kernel_pde(v, pde);
+}
+
+int unmap(uintptr_t v, int num_pages) {
+  unsigned lsz = large_page_size(), lpages = lsz / PAGE_SIZE;
+
+  for (int i = 0; i < num_pages; ) {
+    uintptr_t vi = v + i * PAGE_SIZE;
+
+    /* We do sanity checks to ensure what we're unmapping actually exists,
+       else we'll get a page fault somewhere down the line... */
+    sync_from_ref(vi);
+
+    uintptr_t r = vi;
+    int ints = region_lock_acquire(r);
+
+    uint64_t pde = get_pde(vi);
+    if ((pde & X86_PRESENT) == 0)
+      panic("Tried to unmap a page that doesn't have its table mapped!");
+
+    if (is_large(pde)) {
+      if ((unsigned)(num_pages - i) >= lpages && (vi & (lsz - 1)) == 0) {
+        set_pde(vi, 0);
+        invlpg_pde(vi);
+        sync_kernel_pde(vi, pde);
+        region_lock_release(r, ints);
+        i += lpages;
+        continue;
+      }
+      /* Unmapping part of a large page: break it up first. */
+      split_large_page(vi);
+    }
+    unshare_table(vi);
+
+    unsigned n = pages_in_table(vi, num_pages - i);
+    for (unsigned j = 0; j < n; ++j, vi += PAGE_SIZE) {
+      uint64_t pte = get_pte(vi);
+      if ((pte & (X86_PRESENT | X86_LAZY)) == 0)
+        panic("Tried to unmap a page that isn't mapped!");
+
+      if (pte & X86_COW)
+        cow_refcnt_dec(entry_addr(pte));
 
-  if (*PAGE_TABLE_ENTRY(RPDT_BASE, v) & X86_PRESENT) {
-    kprintf("*** mapping %x to %x with flags %x\n", v, (uint32_t)p, flags);
-    panic("Tried to map a page that was already mapped!");
+      set_pte_counted(vi, 0);
+    }
+    reclaim_table(vi - PAGE_SIZE);
+    region_lock_release(r, ints);
+    i += n;
   }
 
-  *PAGE_TABLE_ENTRY(RPDT_BASE, v) = (p & 0xFFFFF000) |
-    to_x86_flags(flags) | X86_PRESENT;
-  dbg("map: About to release spinlock\n");
-  spinlock_release(&current->lock);
-  dbg("map: released spinlock\n");
+  /* Invalidate the TLB entries all together once the tables are updated.
+     Kernel entries are global, so need more than a CR3 reload. */
+  if (num_pages > INVLPG_MAX && IS_KERNEL_ADDR(v))
+    flush_tlb_all();
+  else if (num_pages > INVLPG_MAX)
+    write_cr3(read_cr3());
+  else
+    for (int i = 0; i < num_pages; ++i)
+      invlpg(v + i * PAGE_SIZE);
+
   return 0;
 }
 
-int map(uintptr_t v, uint64_t p, int num_pages, unsigned flags) {
-  for (int i = 0; i < num_pages; ++i) {
-    if (map_one_page(v+i*0x1000, p+i*0x1000, flags) == -1)
-      return -1;
-    dbg("MAP DONE\n");
+/* remap(), called with the region lock held. */
+static int remap_page(uintptr_t v, uint64_t old, uint64_t p, unsigned flags) {
+  sync_from_ref(v);
+  uint64_t pde = get_pde(v);
+  if ((pde & X86_PRESENT) == 0 || is_large(pde))
+    return -1;
+  unshare_table(v);
+
+  uint64_t pte = get_pte(v);
+  if ((pte & X86_PRESENT) == 0 || entry_addr(pte) != old)
+    return -1;
+
+  /* Others still share the page, so it can't become writable here. */
+  if (p == old && (pte & X86_COW) && (flags & PAGE_COW) == 0 &&
+      cow_refcnt(old) > 1)
+    return -1;
+
+  if (pte & X86_COW)
+    cow_refcnt_dec(old);
+  if (flags & PAGE_COW) {
+    cow_refcnt_inc(p);
+    flags &= ~PAGE_WRITE;
   }
-  dbg("RET\n");
+
+  uint64_t f = to_x86_flags(flags) | X86_PRESENT;
+  if (pge && IS_KERNEL_ADDR(v))
+    f |= X86_GLOBAL;
+  set_pte(v, p | f);
+  invlpg(v);
   return 0;
 }
 
-static int unmap_one_page(uintptr_t v) {
-  spinlock_acquire(&current->lock);
+int remap(uintptr_t v, uint64_t old, uint64_t p, unsigned flags) {
+  int ints = region_lock_acquire(v);
+  int ret = remap_page(v & ~(PAGE_SIZE - 1), old, p, flags);
+  region_lock_release(v, ints);
+  return ret;
+}
 
-  /** We do sanity checks to ensure what we're unmapping actually exists, else we'll
-      get a page fault somewhere down the line... { */
+/** } */
 
-  if ((*PAGE_DIR_ENTRY(RPDT_BASE, v) & X86_PRESENT) == 0)
-    panic("Tried to unmap a page that doesn't have its table mapped!");
+void copy_to_page(uint64_t p, const void *src) {
+  void *v = kmap_atomic(p);
+  memcpy(v, src, PAGE_SIZE);
+  kunmap_atomic(v);
+}
 
-  uint32_t *pte = PAGE_TABLE_ENTRY(RPDT_BASE, v);
-  if ((*pte & X86_PRESENT) == 0)
-    panic("Tried to unmap a page that isn't mapped!");
+/** Lazy reservations are non-present entries with X86_LAZY set and the eventual flags in their usual places. { */
 
-  /** Again, ignore this stuff about copy-on-write, we'll cover it later. { */
+int map_lazy(uintptr_t v, int num_pages, unsigned flags) {
+  uint64_t marker = to_x86_flags(flags & ~PAGE_COW) | X86_LAZY;
 
-  uint32_t p = *pte & 0xFFFFF000;
-  if (*pte & X86_COW)
-    cow_refcnt_dec(p);
+  for (int i = 0; i < num_pages; ) {
+    uintptr_t vi = v + i * PAGE_SIZE;
 
- *pte = 0;
+    uintptr_t r = vi;
+    int ints = region_lock_acquire(r);
 
-  /* Invalidate TLB entry. */
-  uintptr_t *pv = (uintptr_t*)v;
-  __asm__ volatile("invlpg %0" : : "m" (*pv));
+    ensure_page_table_mapped(vi);
+    unshare_table(vi);
+    if (is_large(get_pde(vi)))
+      panic("Tried to reserve a page inside a large page!");
+
+    unsigned n = pages_in_table(vi, num_pages - i);
+    for (unsigned j = 0; j < n; ++j, vi += PAGE_SIZE) {
+      if (get_pte(vi) & X86_PRESENT)
+        panic("Tried to reserve a page that was already mapped!");
+      set_pte_counted(vi, marker);
+    }
+    region_lock_release(r, ints);
+    i += n;
+  }
 
-  spinlock_release(&current->lock);
   return 0;
 }
 
-int unmap(uintptr_t v, int num_pages) {  
+/* Back the page at 'v' if it is reserved. Returns 1 if it is mapped
+   afterwards, else 0. */
+static int populate_page(uintptr_t v) {
+  int ret = 0;
+  v &= ~(PAGE_SIZE - 1);
+  sync_from_ref(v);
+
+  int ints = region_lock_acquire(v);
+  /* The table may have been shared again since the caller looked. */
+  unshare_table(v);
+
+  uint64_t pde = get_pde(v);
+  if (is_large(pde)) {
+    ret = 1;
+  } else if (pde & X86_PRESENT) {
+    uint64_t pte = get_pte(v);
+    if (pte & X86_PRESENT) {
+      /* Someone else got here first. */
+      ret = 1;
+    } else if (pte & X86_LAZY) {
+      uint64_t p = alloc_page(PAGE_REQ_NONE | PAGE_REQ_ZERO);
+      if (p == ~0ULL)
+        panic("Out of memory backing a lazily mapped page!");
+
+      uint64_t f = (pte & 0xFFF & ~(uint64_t)X86_LAZY) | X86_PRESENT;
+      if (pge && IS_KERNEL_ADDR(v))
+        f |= X86_GLOBAL;
+      set_pte(v, p | f);
+      ret = 1;
+    }
+  }
+
+  region_lock_release(v, ints);
+  return ret;
+}
+
+/* unshare_table(), for callers that don't hold the region lock. */
+static void unshare(uintptr_t v) {
+  if (IS_KERNEL_ADDR(v) || (get_pde(v) & X86_SHARED) == 0)
+    return;
+  int ints = region_lock_acquire(v);
+  unshare_table(v);
+  region_lock_release(v, ints);
+}
+
+int populate(uintptr_t v, int num_pages) {
   for (int i = 0; i < num_pages; ++i) {
-    if (unmap_one_page(v+i*0x1000) == -1)
-      return -1;
+    unshare(v + i * PAGE_SIZE);
+    populate_page(v + i * PAGE_SIZE);
   }
   return 0;
 }
 
+/** } */
+
 static int page_fault(regs_t *regs, void *ptr) {
   /* Get the faulting address from the %cr2 register. */
   uint32_t cr2 = read_cr2();
 
+  /* A kernel page table that this address space hasn't picked up yet. */
+  if (sync_from_ref(cr2))
+    return 0;
+
+  /* A fault in a region whose page table is still shared after a clone.
+     Take a copy and retry; if the page itself needs copying too, that
+     faults again. */
+  if (!IS_KERNEL_ADDR(cr2) && (get_pde(cr2) & X86_SHARED)) {
+    unshare(cr2);
+    return 0;
+  }
+
+  /* First touch of a page reserved by map_lazy(). */
+  if ((regs->error_code & X86_PRESENT) == 0 && populate_page(cr2))
+    return 0;
+
   /** Ignore this copy-on-write stuff for now. { */
   if (cow_handle_page_fault(cr2, regs->error_code))
     return 0;
@@ -156,27 +1014,98 @@ static int page_fault(regs_t *regs, void *ptr) {
   return 0;
 }
 
-uintptr_t iterate_mappings(uintptr_t v) {
-  while (v < 0xFFFFF000) {
-    v += 0x1000;
-    if (is_mapped(v))
-      return v;
+/* Look up 'v', setting '*p' to the physical address it maps to (or ~0ULL)
+   and '*flags'. Returns how many bytes on from 'v' are known to follow
+   the same way: the rest of the table if there isn't one or it is a large
+   page, else one page. */
+static uintptr_t lookup(uintptr_t v, uint64_t *p, unsigned *flags) {
+  unsigned tsz = pae ? PAE_TABLE_SIZE : PAGE_TABLE_SIZE;
+  uintptr_t rest = tsz - (v & (tsz - 1));
+
+  sync_from_ref(v);
+  uint64_t pde = get_pde(v);
+  if ((pde & X86_PRESENT) == 0) {
+    *p = ~0ULL;
+    return rest;
+  }
+  if (is_large(pde)) {
+    *p = large_addr(pde) + (v & (tsz - 1));
+    *flags = from_x86_flags(pde & 0xFFF);
+    return rest;
+  }
+
+  uint64_t pte = get_pte(v);
+  *p = (pte & X86_PRESENT) ? entry_addr(pte) : ~0ULL;
+  *flags = from_x86_flags(pte & 0xFFF);
+  return PAGE_SIZE;
+}
+
+int next_mapping_run(uintptr_t v, mapping_run_t *run) {
+  uint64_t p;
+  unsigned flags;
+
+  /* Find the first mapped page... */
+  v &= ~(PAGE_SIZE - 1);
+  for (;;) {
+    uintptr_t n = lookup(v, &p, &flags);
+    if (p != ~0ULL)
+      break;
+    if (v > UINTPTR_MAX - n)
+      return -1;
+    v += n;
+  }
+
+  run->start = v;
+  run->phys = p;
+  run->flags = flags;
+
+  /* ... then extend the run while the pages follow on from it. */
+  uint64_t expect = p;
+  for (;;) {
+    uint64_t q;
+    unsigned f;
+    uintptr_t n = lookup(v, &q, &f);
+    if (q != expect || f != flags)
+      break;
+    if (v > UINTPTR_MAX - n) {
+      /* The run goes up to the top of the address space. */
+      v = 0;
+      break;
+    }
+    v += n;
+    expect += n;
   }
-  return ~0UL;
+  run->end = v - 1;
+  return 0;
+}
+
+uintptr_t iterate_mappings(uintptr_t v) {
+  mapping_run_t run;
+  if (v >= 0xFFFFF000 || next_mapping_run(v + PAGE_SIZE, &run) == -1)
+    return ~0UL;
+  return run.start;
 }
 
 uint64_t get_mapping(uintptr_t v, unsigned *flags) {
-  if ((*PAGE_DIR_ENTRY(RPDT_BASE, v) & X86_PRESENT) == 0)
+  sync_from_ref(v);
+  uint64_t pde = get_pde(v);
+  if ((pde & X86_PRESENT) == 0)
     return ~0ULL;
 
-  uint32_t *page_table_entry = PAGE_TABLE_ENTRY(RPDT_BASE, v);
-  if ((*page_table_entry & X86_PRESENT) == 0)
+  if (is_large(pde)) {
+    if (flags)
+      *flags = from_x86_flags(pde & 0xFFF);
+    return large_addr(pde) + (v & (large_page_size() - 1) & ~0xFFFU);
+  }
+
+  uint64_t pte = get_pte(v);
+  if ((pte & X86_PRESENT) == 0)
     return ~0ULL;
 
   if (flags)
-    *flags = from_x86_flags(*page_table_entry & 0xFFF);
+    *flags = from_x86_flags(pte & 0xFFF);
 
-  return *page_table_entry & 0xFFFFF000;
+  return entry_addr(pte);
 }
 
 int is_mapped(uintptr_t v) {
@@ -184,16 +1113,121 @@ int is_mapped(uintptr_t v) {
   return get_mapping(v, &flags) != ~0ULL;
 }
 
-int init_virtual_memory() {
+unsigned get_large_page_size() {
+  return large_page_size();
+}
+
+/* CPUID leaf 1 feature flags (EDX). */
+static uint32_t cpu_features() {
+  uint32_t a, b, c, d;
+  __asm__ volatile("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d) : "a" (1));
+  return d;
+}
+
+/* Does the processor support PAE? CPUID leaf 1, EDX bit 6. */
+static int cpu_has_pae() {
+  return (cpu_features() >> 6) & 1;
+}
+
+/* Does the processor support 4MB pages? CPUID leaf 1, EDX bit 3. */
+static int cpu_has_pse() {
+  return (cpu_features() >> 3) & 1;
+}
+
+/* Does the processor support global pages? CPUID leaf 1, EDX bit 13. */
+static int cpu_has_pge() {
+  return (cpu_features() >> 13) & 1;
+}
+
+/* Turn on global pages, and mark the kernel image mapped at boot (the
+   first page table of kernel space) global. */
+static void enable_global_pages() {
+  write_cr4(read_cr4() | CR4_PGE);
+  pge = 1;
+
+  for (uintptr_t v = MMAP_KERNEL_START;
+       v < MMAP_KERNEL_START + PAGE_TABLE_SIZE; v += PAGE_SIZE) {
+    uint64_t pte = get_pte(v);
+    if (pte & X86_PRESENT)
+      set_pte(v, pte | X86_GLOBAL);
+  }
+  flush_tlb_all();
+}
+
+/* Defined in boot.s. Turns paging off, sets CR4.PAE, loads 'pdpt' into CR3
+   and turns paging back on. */
+extern void pae_enable(uint32_t pdpt);
+
+/* Allocate an early page and return it zeroed and mapped at scratch slot
+   'slot'. */
+static void *early_table(unsigned slot, uint64_t *phys) {
+  *phys = early_alloc_page();
+  void *t = map_scratch(slot, *phys);
+  memset(t, 0, PAGE_SIZE);
+  return t;
+}
+
+/** Switching to PAE means building a complete new set of tables while the old ones are live. Each present boot-time page table (4MB, 1024 entries) becomes two PAE tables (2MB, 512 entries each). The new tables aren't mapped anywhere, so they are written through the scratch slots. { */
+
+static void switch_to_pae(address_space_t *a) {
+  uint64_t pdpt, pds[4], nt;
+  for (unsigned i = 0; i < 4; ++i)
+    early_table(0, &pds[i]);
+  uint64_t *pdpt_v = early_table(0, &pdpt);
+  for (unsigned i = 0; i < 4; ++i)
+    /* PDPT entries have no write or user bits outside long mode. */
+    pdpt_v[i] = pds[i] | X86_PRESENT;
+
+  /* Skip the last two entries, which belong to the legacy recursive map. */
+  for (unsigned k = 0; k < 1022; ++k) {
+    uint32_t pde = *PAGE_DIR_ENTRY(RPDT_BASE, k * PAGE_TABLE_SIZE);
+    if ((pde & X86_PRESENT) == 0)
+      continue;
+
+    for (unsigned h = 0; h < 2; ++h) {
+      uint64_t *ntv = early_table(0, &nt);
+      uint32_t *lt = map_scratch(1, pde & 0xFFFFF000);
+      for (unsigned e = 0; e < 512; ++e)
+        ntv[e] = lt[h * 512 + e];
+
+      unsigned idx = k * 2 + h;
+      uint64_t *pd = map_scratch(2, pds[idx >> 9]);
+      pd[idx & 511] = nt | (pde & (X86_PRESENT | X86_WRITE | X86_USER));
+    }
+  }
+
+  /* The recursive map: the four directories go in the last four entries. */
+  uint64_t *pd3 = map_scratch(2, pds[3]);
+  for (unsigned i = 0; i < 4; ++i)
+    pd3[508 + i] = pds[i] | X86_PRESENT | X86_WRITE;
+
+  int ints = get_interrupt_state();
+  disable_interrupts();
+  pae_enable((uint32_t)pdpt);
+  pae = 1;
+  a->directory = (uint32_t*)(uintptr_t)pdpt;
+  kernel_ref_dir = pds[3];
+  set_interrupt_state(ints);
+
+  /* The scratch slots were copied across still mapped. */
+  for (unsigned i = 0; i < MMAP_SCRATCH_SLOTS; ++i)
+    unmap_scratch(i);
+}
+
+/** } */
+
+int init_virtual_memory(range_t *ranges, unsigned nranges) {
   /* Initialise the initial address space object. */
   static address_space_t a;
   /** We set up paging earlier during boot. The page directory is stored in the special register ``%cr3``, so we need to fetch it back. { */
   uint32_t d = read_cr3();
   a.directory = (uint32_t*) (d & 0xFFFFF000);
+  a.next = NULL;
 
-  spinlock_init(&a.lock);
-  
   current = &a;
+  address_spaces = &a;
+  kernel_ref = &a;
+  kernel_ref_dir = (uintptr_t)a.directory;
 
   /* We normally can't write directly to the page directory because it will
      be in physical memory that isn't mapped. However, the initial directory
@@ -202,21 +1236,50 @@ int init_virtual_memory() {
   /* Recursive page directory trick - map the page directory onto itself. */
   a.directory[1023] = (uint32_t)a.directory | X86_PRESENT | X86_WRITE;
 
-  /* Ensure that page tables are allocated for the whole of kernel space. */
-  uint32_t *last_table = 0;
-  for (uint64_t addr = MMAP_KERNEL_START; addr < MMAP_KERNEL_END; addr += 0x1000) {
-    uint32_t *pde = PAGE_DIR_ENTRY(RPDT_BASE, (uint32_t)addr);
-    if (pde != last_table) {
-      if ((*pde & X86_PRESENT) == 0) {
-        *pde = early_alloc_page() | X86_PRESENT | X86_WRITE;
+  /* The fixmap is needed before anything else. Its table also holds the
+     scratch slots, which switching to PAE uses. init_physical_memory()
+     maps its bitmaps before alloc_page() works, so their tables come from
+     early_alloc_page() too. Other kernel tables are made as they are
+     needed. */
+  for (uintptr_t v = MMAP_PMM_BITMAP & ~(PAGE_TABLE_SIZE-1);
+       v < MMAP_FIXMAP_END; v += PAGE_TABLE_SIZE) {
+    if ((get_pde(v) & X86_PRESENT) == 0) {
+      set_pde(v, early_alloc_page() | X86_PRESENT | X86_WRITE);
+      memset(PAGE_TABLE_ENTRY(RPDT_BASE, v), 0, PAGE_SIZE);
+    }
+  }
+
+  /* boot.s points both the identity map at 0 and kernel space at the same
+     table. Give kernel space its own copy, so that what is done to one
+     half (global pages, copy-on-write) doesn't happen to the other. */
+  if ((get_pde(0) & X86_PRESENT) &&
+      entry_addr(get_pde(0)) == entry_addr(get_pde(MMAP_KERNEL_START))) {
+    uint64_t p = early_alloc_page();
+    void *t = map_scratch(0, p);
+    memcpy(t, PAGE_TABLE_ENTRY(RPDT_BASE, 0), PAGE_SIZE);
+    unmap_scratch(0);
+    set_pde(MMAP_KERNEL_START, p | X86_PRESENT | X86_WRITE);
+    write_cr3(read_cr3());
+  }
 
-        memset(PAGE_TABLE_ENTRY(RPDT_BASE, (uint32_t)addr), 0, 0x1000);
-      }
+  /* Use PAE if there is memory that we couldn't otherwise reach. */
+  uint64_t extent = 0;
+  for (unsigned i = 0; i < nranges; ++i)
+    if (ranges[i].start + ranges[i].extent > extent)
+      extent = ranges[i].start + ranges[i].extent;
 
-      last_table = pde;
+  if (extent > 0x100000000ULL && cpu_has_pae()) {
+    switch_to_pae(&a);
+  } else {
+    if (cpu_has_pse()) {
+      write_cr4(read_cr4() | CR4_PSE);
+      pse = 1;
     }
   }
 
+  if (cpu_has_pge())
+    enable_global_pages();
+
   /* Register the page fault handler. */
   register_interrupt_handler(14, &page_fault, NULL);
 
@@ -227,60 +1290,270 @@ int init_virtual_memory() {
   return 0;
 }
 
+/* Create a copy of the page table covering 'base' in the current address
+   space, returning its physical address. */
+static uint64_t clone_table(uintptr_t base) {
+  uint64_t p = alloc_table();
+
+  int ints = get_interrupt_state();
+  disable_interrupts();
+  spinlock_acquire(&table_lock);
+  set_table_frame(p, copy_table(entry_addr(get_pde(base)), p,
+                                /*make_cow=*/0));
+  spinlock_release(&table_lock);
+  set_interrupt_state(ints);
+  return p;
+}
+
+/* The directory entry for user address 'v' in a clone of the current
+   address space. Tables are shared copy-on-write, or copied if the pages
+   themselves are to be shared. Called with the region lock held. */
+static uint64_t clone_user_pde(uintptr_t v, int make_cow) {
+  uint64_t e = get_pde(v);
+  if ((e & X86_PRESENT) == 0)
+    return e;
+
+  /* A kernel-only table in user space, like the boot identity map, is
+     the kernel's memory. Copy it without making anything copy-on-write. */
+  if ((e & X86_USER) == 0)
+    return is_large(e) ? e : clone_table(v) | (e & 0xFFF);
+
+  if (is_large(e)) {
+    /* A large page can't be copy-on-write, so split it. Read-only or
+       shared ones can be mapped as they are. */
+    if (!make_cow || (e & X86_WRITE) == 0)
+      return e;
+    split_large_page(v);
+    e = get_pde(v);
+  }
+  if (make_cow)
+    return share_table(v);
+  return clone_table(v) | (e & 0xFFF & ~(uint64_t)X86_SHARED) | X86_WRITE;
+}
+
+/* The directory entry for 'v' in a clone of the current address space:
+   the reference entry for kernel space. Called with as_list_lock held. */
+static uint64_t clone_pde(uintptr_t v, int make_cow) {
+  if (IS_KERNEL_ADDR(v))
+    return get_ref_pde(v);
+
+  int ints = region_lock_acquire(v);
+  uint64_t e = clone_user_pde(v, make_cow);
+  region_lock_release(v, ints);
+  return e;
+}
+
+/* Allocate the PDPT and four directories of a new PAE address space. On
+   failure, frees whatever it did get and returns -1. */
+static int alloc_pae_dirs(uint64_t *pdpt, uint64_t pds[4]) {
+  *pdpt = alloc_page(PAGE_REQ_UNDER4GB | PAGE_REQ_ZERO);
+  int failed = *pdpt == ~0ULL;
+  for (unsigned i = 0; i < 4; ++i) {
+    pds[i] = alloc_page(PAGE_REQ_NONE | PAGE_REQ_ZERO);
+    failed |= pds[i] == ~0ULL;
+  }
+  if (!failed)
+    return 0;
+
+  if (*pdpt != ~0ULL)
+    free_page(*pdpt);
+  for (unsigned i = 0; i < 4; ++i)
+    if (pds[i] != ~0ULL)
+      free_page(pds[i]);
+  return -1;
+}
+
 int clone_address_space(address_space_t *dest, int make_cow) {
-  spinlock_acquire(&global_vmm_lock);
-
-  /* Allocate a page for the new page directory */
-  uint32_t p = alloc_page(PAGE_REQ_NONE);
-  
-  spinlock_init(&dest->lock);
-  dest->directory = (uint32_t*)p;
-
-  /* Map the new directory temporarily in so we can populate it. */
-  uint32_t base_addr = (uint32_t)PAGE_TABLE_ENTRY(RPDT_BASE2, 0);
-  uint32_t base_dir_addr = (uint32_t)PAGE_DIR_ENTRY(RPDT_BASE2, 0);
-  dbg("base_addr = %x\n", base_addr);
-  *PAGE_DIR_ENTRY(RPDT_BASE, base_addr) = p | X86_WRITE | X86_PRESENT;
-  *PAGE_TABLE_ENTRY(RPDT_BASE, base_dir_addr) = p | X86_WRITE | X86_PRESENT;
-  /* FIXME: invlpg */
-
-  /* Iterate over all PDE's in the source directory except the last 
-     two which are reserved for the page dir trick. */
-  for (uint32_t i = 0; i < MMAP_KERNEL_END; i += PAGE_TABLE_SIZE) {
-    dbg("about to map %x, %x\n", i, (uint32_t)PAGE_DIR_ENTRY(RPDT_BASE2,i));
-    /** By default every page directory entry in the new address space is the same as in the old address space. */
-    *PAGE_DIR_ENTRY(RPDT_BASE2, i) = *PAGE_DIR_ENTRY(RPDT_BASE, i);
-    dbg("here1\n");
-    int is_user = ! IS_KERNEL_ADDR( PAGE_TABLE_SIZE * i );
-
-    /** However, if the directory entry is present and is user-mode, we need
-        to clone it to ensure that updates in the old address space don't affect
-        the new address space and vice versa. { */
-    /* Now we have to decide whether to copy/clone the current page table.
-       We need to clone if it is present, and if it a user-mode page table. */
-    if ((*PAGE_DIR_ENTRY(RPDT_BASE, i) & X86_PRESENT) && is_user) {
-      dbg("here2\n");
-      /* Create a new page table. */
-      uint32_t p2 = alloc_page(PAGE_REQ_UNDER4GB);
-      *PAGE_DIR_ENTRY(RPDT_BASE2, i) = p2 | X86_WRITE | X86_USER | X86_PRESENT;
-
-      /* Copy every contained page table entry over. */
-      for (unsigned j = 0; j < 1024; ++j) {
-        uint32_t *d_pte = PAGE_TABLE_ENTRY(RPDT_BASE2, i + j * PAGE_SIZE);
-        uint32_t *s_pte = PAGE_TABLE_ENTRY(RPDT_BASE,  i + j * PAGE_SIZE);
-
-        /* If the page is user-mode and writable, make it copy-on-write. */
-        if (make_cow && is_user && (*s_pte & X86_WRITE)) {
-          *d_pte = (*s_pte & ~X86_WRITE) | X86_COW;
-          cow_refcnt_inc(*s_pte & 0xFFFFF000);
-        }
+  /* as_list_lock is held while copying so no kernel entry changes
+     underneath. User regions are locked one at a time as they are
+     copied. */
+  int ints;
+
+  /** By default every page directory entry in the new address space is the same as in the old address space. However, if the directory entry is present and is user-mode, we need to clone it to ensure that updates in the old address space don't affect the new address space and vice versa. The new directories are written through kmap_atomic(). { */
+
+  if (pae) {
+    uint64_t pdpt, pds[4];
+    if (alloc_pae_dirs(&pdpt, pds) != 0)
+      return -1;
+
+    ints = as_list_lock_acquire();
+    for (unsigned i = 0; i < 4; ++i) {
+      uint64_t *pd = kmap_atomic(pds[i]);
+      for (unsigned j = 0; j < 512; ++j) {
+        uintptr_t v = (i << 30) | (j << 21);
+        pd[j] = (v >= MMAP_KERNEL_END) ?
+          /* The recursive map points at the new directories. */
+          pds[j - 508] | X86_PRESENT | X86_WRITE :
+          clone_pde(v, make_cow);
       }
+      kunmap_atomic(pd);
+    }
+
+    uint64_t *pdpt_v = kmap_atomic(pdpt);
+    for (unsigned i = 0; i < 4; ++i)
+      pdpt_v[i] = pds[i] | X86_PRESENT;
+    kunmap_atomic(pdpt_v);
+    dest->directory = (uint32_t*)(uintptr_t)pdpt;
+
+  } else {
+    uint64_t dir = alloc_page(PAGE_REQ_UNDER4GB | PAGE_REQ_ZERO);
+    if (dir == ~0ULL)
+      return -1;
+
+    ints = as_list_lock_acquire();
+    /* Skip the last two entries, which are reserved for the page dir
+       trick. */
+    uint32_t *d = kmap_atomic(dir);
+    for (unsigned k = 0; k < 1022; ++k)
+      d[k] = (uint32_t)clone_pde(k * PAGE_TABLE_SIZE, make_cow);
+    d[RPDT_BASE] = dir | X86_PRESENT | X86_WRITE;
+    kunmap_atomic(d);
+    dest->directory = (uint32_t*)(uintptr_t)dir;
+  }
+
+  /** } */
+
+  dest->next = address_spaces;
+  address_spaces = dest;
+  as_list_lock_release(ints);
+
+  /* Pages in our own address space may have become read-only. */
+  write_cr3(read_cr3());
+
+  return 0;
+}
+
+int create_address_space(address_space_t *dest) {
+
+  /* Only kernel space and the recursive map are filled in. */
+  if (pae) {
+    uint64_t pdpt, pds[4];
+    if (alloc_pae_dirs(&pdpt, pds) != 0)
+      return -1;
+
+    int ints = as_list_lock_acquire();
+
+    /* Kernel space starts at the last directory. */
+    uint64_t *pd = kmap_atomic(pds[3]);
+    for (unsigned j = 0; j < 512; ++j) {
+      uintptr_t v = (3U << 30) | (j << 21);
+      pd[j] = (v >= MMAP_KERNEL_END) ?
+        pds[j - 508] | X86_PRESENT | X86_WRITE :
+        get_ref_pde(v);
+    }
+    kunmap_atomic(pd);
+
+    uint64_t *pdpt_v = kmap_atomic(pdpt);
+    for (unsigned i = 0; i < 4; ++i)
+      pdpt_v[i] = pds[i] | X86_PRESENT;
+    kunmap_atomic(pdpt_v);
+    dest->directory = (uint32_t*)(uintptr_t)pdpt;
+
+    dest->next = address_spaces;
+    address_spaces = dest;
+    as_list_lock_release(ints);
+
+  } else {
+    uint64_t dir = alloc_page(PAGE_REQ_UNDER4GB | PAGE_REQ_ZERO);
+    if (dir == ~0ULL)
+      return -1;
+
+    int ints = as_list_lock_acquire();
+
+    uint32_t *d = kmap_atomic(dir);
+    for (unsigned k = MMAP_KERNEL_START / PAGE_TABLE_SIZE; k < 1022; ++k)
+      d[k] = (uint32_t)get_ref_pde(k * PAGE_TABLE_SIZE);
+    d[RPDT_BASE] = dir | X86_PRESENT | X86_WRITE;
+    kunmap_atomic(d);
+    dest->directory = (uint32_t*)(uintptr_t)dir;
+
+    dest->next = address_spaces;
+    address_spaces = dest;
+    as_list_lock_release(ints);
+  }
+
+  return 0;
+}
+
+/* Drop a directory's use of the user page table in 'pde'. The last user
+   releases the copy-on-write references in it and frees it. */
+static void release_table(uint64_t pde) {
+  uint64_t t = entry_addr(pde);
+
+  if (pde & X86_SHARED) {
+    page_frame_t *pf = get_page_frame(t);
+
+    int ints = get_interrupt_state();
+    disable_interrupts();
+    spinlock_acquire(&table_lock);
+    int last = pf->refcnt <= 1;
+    if (last)
+      pf->refcnt = 0;
+    else
+      --pf->refcnt;
+    spinlock_release(&table_lock);
+    set_interrupt_state(ints);
+
+    if (!last)
+      return;
+  }
+
+  void *tv = kmap_atomic(t);
+  unsigned n = pae ? 512 : 1024;
+  for (unsigned j = 0; j < n; ++j) {
+    uint64_t pte = pae ? ((uint64_t*)tv)[j] : ((uint32_t*)tv)[j];
+    if ((pte & X86_PRESENT) && (pte & X86_COW))
+      cow_refcnt_dec(entry_addr(pte));
+  }
+  kunmap_atomic(tv);
+
+  get_page_frame(t)->flags = 0;
+  free_page(t);
+}
+
+/* Release the user page tables in the first 'n' entries of the directory
+   at physical address 'dir'. */
+static void release_tables(uint64_t dir, unsigned n) {
+  void *d = kmap_atomic(dir);
+  for (unsigned j = 0; j < n; ++j) {
+    uint64_t e = pae ? ((uint64_t*)d)[j] : ((uint32_t*)d)[j];
+    if ((e & X86_PRESENT) && !is_large(e))
+      release_table(e);
+  }
+  kunmap_atomic(d);
+}
+
+int destroy_address_space(address_space_t *as) {
+  if (as == current || as == kernel_ref)
+    return -1;
+
+  int ints = as_list_lock_acquire();
+  for (address_space_t **pp = &address_spaces; *pp; pp = &(*pp)->next) {
+    if (*pp == as) {
+      *pp = as->next;
+      break;
     }
   }
-  dbg("about to finish\n");
+  as_list_lock_release(ints);
 
-  dbg("finished clone\n");
-  spinlock_release(&global_vmm_lock);
+  uint64_t dir = (uintptr_t)as->directory;
+  if (pae) {
+    uint64_t pds[4];
+    uint64_t *pdpt = kmap_atomic(dir);
+    for (unsigned i = 0; i < 4; ++i)
+      pds[i] = pdpt[i] & PAE_ADDR_MASK;
+    kunmap_atomic(pdpt);
+
+    /* The last directory is all kernel space. */
+    for (unsigned i = 0; i < 3; ++i)
+      release_tables(pds[i], 512);
+    for (unsigned i = 0; i < 4; ++i)
+      free_page(pds[i]);
+  } else {
+    release_tables(dir, MMAP_KERNEL_START / PAGE_TABLE_SIZE);
+  }
+  free_page(dir);
 
+  as->directory = NULL;
   return 0;
 }
@@ -1,5 +1,6 @@
 #include "assert.h"
 #include "hal.h"
+#include "math.h"
 #include "vmspace.h"
 
 int vmspace_init(vmspace_t *vms, uintptr_t addr, uintptr_t sz) {
@@ -30,39 +31,123 @@ int vmspace_init(vmspace_t *vms, uintptr_t addr, uintptr_t sz) {
   return 0;
 }
 
+/* Tag the 'npages' physical pages at 'p' as one block belonging to 'vms'. */
+static void set_owner(vmspace_t *vms, uint64_t p, size_t npages) {
+  for (size_t i = 0; i < npages; ++i) {
+    page_frame_t *pf = get_page_frame(p + i * get_page_size());
+    pf->u.owner = vms;
+    pf->flags = PF_VMSPACE | (i == 0 ? PF_HEAD : 0);
+    pf->order = log2_roundup(npages);
+  }
+}
+
+/* Back 'npages' pages at 'addr' with single pages wherever they can be
+   found, taken a batch at a time so the zone lock is only taken once per
+   batch. */
+#define SCATTER_BATCH 32
+
+static void map_scattered(vmspace_t *vms, uintptr_t addr, size_t npages,
+                          int flags) {
+  uint64_t pages[SCATTER_BATCH];
+
+  while (npages > 0) {
+    size_t n = (npages < SCATTER_BATCH) ? npages : SCATTER_BATCH;
+    size_t got = alloc_pages_batch(PAGE_REQ_NONE, 1, n, pages);
+    assert(got == n && "Out of memory!");
+
+    for (size_t i = 0; i < n; ++i) {
+      int ok = map(addr, pages[i], 1, flags);
+      assert(ok == 0 && "vmspace_alloc: map failed!");
+      set_owner(vms, pages[i], 1);
+      addr += get_page_size();
+    }
+    npages -= n;
+  }
+}
+
 uintptr_t vmspace_alloc(vmspace_t *vms, unsigned sz, int alloc_phys) {
   /* FIXME: Assert sz is page aligned. */
   spinlock_acquire(&vms->lock);
 
   uint64_t addr = buddy_alloc(&vms->allocator, sz);
 
-  if (alloc_phys && addr != ~0ULL) {
+  if ((alloc_phys & VMSPACE_LAZY) && addr != ~0ULL) {
+    int ok = map_lazy(addr, sz >> get_page_shift(),
+                      alloc_phys & ~VMSPACE_LAZY);
+    assert(ok == 0 && "vmspace_alloc: map_lazy failed!");
+
+  } else if (alloc_phys && addr != ~0ULL) {
     size_t npages = sz >> get_page_shift();
-    uintptr_t phys_pages = alloc_pages(PAGE_REQ_NONE, npages);
-    assert(phys_pages != ~0UL && phys_pages != ~0UL && "Out of memory!");
-    int ok = map(addr, phys_pages, npages, alloc_phys);
-    assert(ok == 0 && "vmspace_alloc: map failed!");
+    /* Line the physical pages up with the (naturally aligned) virtual
+       block so that map() can use large pages. */
+    unsigned lsz = get_large_page_size();
+    uint64_t phys_pages = (lsz && sz >= lsz) ?
+      alloc_pages_aligned(PAGE_REQ_NONE, npages, lsz) :
+      alloc_pages(PAGE_REQ_NONE, npages);
+    if (phys_pages == ~0ULL) {
+      /* Memory is too fragmented for a contiguous run; vmspace_free()
+         copes with pages that aren't one block. */
+      map_scattered(vms, addr, npages, alloc_phys);
+    } else {
+      int ok = map(addr, phys_pages, npages, alloc_phys);
+      assert(ok == 0 && "vmspace_alloc: map failed!");
+      set_owner(vms, phys_pages, npages);
+    }
   }
 
   spinlock_release(&vms->lock);
   return addr;
 }
 
+/* Is the page at 'p' the start of a block vmspace_alloc() gave 'vms' of
+   'npages' physically contiguous pages? A slab cache retags the frames of
+   the blocks it gets with itself as owner, but keeps the block's head and
+   order, so those count too. */
+static int is_whole_block(vmspace_t *vms, uint64_t p, size_t npages) {
+  page_frame_t *pf = get_page_frame(p);
+  return (pf->flags & PF_HEAD) &&
+    ((pf->flags & PF_SLAB) || pf->u.owner == vms) &&
+    ((size_t)1 << pf->order) == npages;
+}
+
 void vmspace_free(vmspace_t *vms, unsigned sz, uintptr_t addr, int free_phys) {
   spinlock_acquire(&vms->lock);
 
   if (free_phys) {
     unsigned pgsz = get_page_size();
-    for (unsigned i = 0; i < sz; i += pgsz) {
-      uint64_t p = get_mapping(addr + i, NULL);
-      assert(p != ~0ULL &&
-             "vmspace_free asked to free_phys but mapping did not exist!");
-      free_page(p);
-      unmap(addr + i, 1);
+    size_t npages = sz >> get_page_shift();
+    uint64_t p = get_mapping(addr, NULL);
+
+    if (p != ~0ULL && is_whole_block(vms, p, npages)) {
+      /* Free it in one go. */
+      for (size_t i = 0; i < npages; ++i) {
+        page_frame_t *pf = get_page_frame(p + i * pgsz);
+        pf->u.owner = NULL;
+        pf->flags = 0;
+      }
+      free_pages(p, npages);
+    } else {
+      for (unsigned i = 0; i < sz; i += pgsz) {
+        /* Pages of a lazy region that were never touched have nothing to
+           free. */
+        p = get_mapping(addr + i, NULL);
+        if (p == ~0ULL)
+          continue;
+        page_frame_t *pf = get_page_frame(p);
+        pf->u.owner = NULL;
+        pf->flags = 0;
+        free_page(p);
+      }
     }
+    unmap(addr, npages);
   }
 
   buddy_free(&vms->allocator, addr, sz);
 
   spinlock_release(&vms->lock);
 }
+
+void vmspace_populate(vmspace_t *vms, uintptr_t addr, unsigned sz) {
+  assert(addr >= vms->start && addr + sz <= vms->start + vms->size);
+  populate(addr, sz >> get_page_shift());
+}
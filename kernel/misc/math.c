@@ -10,3 +10,11 @@ unsigned log2_roundup(unsigned n) {
   /* else floor(n) != n, so return l2+1 to round up. */
   return l2+1;
 }
+
+unsigned log2_roundup64(uint64_t n) {
+  unsigned l2 = 63 - __builtin_clzll(n);
+
+  if (n == 1ULL<<l2)
+    return l2;
+  return l2+1;
+}
@@ -33,13 +33,12 @@ static void dbg_backtrace(const char *cmd, core_debug_state_t *states, int core)
     kprintf("\n");
   }
 }
-/*
+
 static void dbg_mappings(const char *cmd, core_debug_state_t *states, int core) {
-  uintptr_t v = 0, old_v = 0, start = 0;
-  unsigned int flags = 0, old_flags = 0;
+  unsigned int flags = 0;
 
-  If the user specified an address, print the mapping for that address
-     instead of all addresses. 
+  /* If the user specified an address, print the mapping for that address
+     instead of all addresses. */
   if (strchr(cmd, ' ')) {
     unsigned long addr = strtoul(strchr(cmd, ' ')+1, NULL, 0);
 
@@ -47,7 +46,7 @@ static void dbg_mappings(const char *cmd, core_debug_state_t *states, int core)
     if (p == ~0ULL) {
       kprintf("%08x - not mapped\n", addr);
     } else {
-       FIXME: Support 64-bit types in printf! 
+      /* FIXME: Support 64-bit types in printf! */
       kprintf("%08x -> %08x ", addr, (uint32_t)p);
       kprint_bitmask("cuxw", flags);
       kprintf("\n");
@@ -55,30 +54,26 @@ static void dbg_mappings(const char *cmd, core_debug_state_t *states, int core)
     return;
   }
 
-  (void)get_mapping(0, &old_flags);
-
-  while (v <= UINTPTR_MAX - get_page_size()) {
-    v = iterate_mappings(v);
-
-    (void)get_mapping(v, &flags);
-    if (old_flags != flags || v != old_v + 0x1000) {
-      kprintf("%08x..%08x ", start, old_v+0x1000);
-      kprint_bitmask("cuxw", old_flags);
-      kprintf("\n");
+  mapping_run_t run;
+  uintptr_t v = 0;
+  while (next_mapping_run(v, &run) == 0) {
+    kprintf("%08x..%08x -> ", run.start, run.end);
+    if (run.phys >> 32)
+      kprintf("%x", (uint32_t)(run.phys >> 32));
+    kprintf("%08x ", (uint32_t)run.phys);
+    kprint_bitmask("cuxw", run.flags);
+    kprintf("\n");
 
-      old_flags = flags;
-      start = v;
-    }
-    old_v = v;
+    if (run.end == UINTPTR_MAX)
+      break;
+    v = run.end + 1;
   }
-
 }
-*/
 
 static int register_commands() {
   register_debugger_handler("print-regs", "Print register values", &dbg_info_regs);
   register_debugger_handler("backtrace", "Print a backtrace", &dbg_backtrace);
-  //register_debugger_handler("inspect-mappings", "Print the V->P mappings", &dbg_mappings);
+  register_debugger_handler("inspect-mappings", "Print the V->P mappings", &dbg_mappings);
   return 0;
 }
 
@@ -16,7 +16,12 @@
 typedef struct kb_state {
   uint32_t flags;
   uint8_t escaped;
+  /* Filled by the interrupt handler, drained by read(). */
   char_ringbuf_t buf;
+  /* The rest of a string found by polling in read() that didn't fit in the
+     caller's buffer. Only read() touches this, so the ring keeps a single
+     producer. */
+  const char *pending;
 } kb_state_t;
 
 static const char *try_scancode(uint32_t flag, uint8_t *table, int len,
@@ -104,7 +109,7 @@ static int read(console_t *obj, char *buf, int len) {
   int n = char_ringbuf_read(&state->buf, buf, len);
   if (n) return n;
 
-  const char *str = NULL;
+  const char *str = state->pending;
   uint8_t sc;
   while (str == NULL) {
     if (!is_scancode_ready()) return 0;
@@ -112,15 +117,11 @@ static int read(console_t *obj, char *buf, int len) {
     str = process_scancode(state, sc);
   }
 
-  /* Special, faster case for a single character */
-  if (str[1] == '\0') {
-    *buf = str[0];
-    return 1;
-  }
-
-  char_ringbuf_write(&state->buf, str, strlen(str));
+  for (n = 0; n < len && str[n] != '\0'; ++n)
+    buf[n] = str[n];
+  state->pending = (str[n] != '\0') ? &str[n] : NULL;
 
-  return char_ringbuf_read(&state->buf, buf, len);
+  return n;
 }
   
 static int kb_int_handler(struct regs *regs, void *p) {
@@ -139,6 +140,7 @@ static char kb_buffer[KB_BUFSZ];
 static kb_state_t kb_state = {
   .flags = 0,
   .escaped = 0,
+  .pending = NULL,
 };
 
 static console_t kb_console = {
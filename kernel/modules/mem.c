@@ -50,14 +50,18 @@ static int free_memory() {
   }
 
   /* Copy the ranges to a backup, as init_physical_memory mutates them and 
-     init_cow_refcnts needs to run after init_physical_memory */
+     init_page_frames needs to run after init_physical_memory */
   for (i = 0; i < n; ++i)
     ranges_cpy[i] = ranges[i];
 
   init_physical_memory_early(ranges, n, extent);
   init_virtual_memory(ranges, n);
   init_physical_memory();
-  init_cow_refcnts(ranges, n);
+  init_page_frames(ranges, n);
+
+  /* Fill the zeroed-page pools up front. free_page() and
+     release_deferred_memory() keep them topped up from then on. */
+  prezero_pages(~0U);
 
   return 0;
 }
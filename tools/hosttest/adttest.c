@@ -0,0 +1,390 @@
+/* Host-side tests and microbenchmarks for the freestanding ADTs in
+   kernel/adt. Run as:
+
+     adttest test    - randomized correctness tests against reference models
+     adttest bench   - ns/op for the hot operations at several region sizes */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "adt/bitmap.h"
+#include "adt/buddy.h"
+#include "adt/ringbuf.h"
+
+#define PAGE_SZ 0x1000ULL
+
+static int failures = 0;
+
+#define check(cond, ...) do {                                   \
+    if (!(cond)) {                                              \
+      printf("  FAIL %s:%d: ", __FILE__, __LINE__);             \
+      printf(__VA_ARGS__);                                      \
+      printf("\n");                                             \
+      ++failures;                                               \
+      return;                                                   \
+    }                                                           \
+  } while (0)
+
+/* xorshift64 - deterministic so failures can be reproduced. */
+static uint64_t rng_state = 0x2545F4914F6CDD1DULL;
+static uint64_t rng() {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*******************************************************************************
+ * Bitmap
+ ******************************************************************************/
+
+static int64_t ref_next(const char *ref, uint64_t n, uint64_t from, char val) {
+  for (uint64_t i = from; i < n; ++i)
+    if (ref[i] == val)
+      return i;
+  return -1;
+}
+
+static void test_bitmap_size(int64_t max_extent, int flags, unsigned iters) {
+  uint64_t n = max_extent + 1;
+  uint8_t *storage = malloc(bitmap_calc_overhead(max_extent, flags));
+  char *ref = calloc(n, 1);
+  bitmap_t b;
+  bitmap_init(&b, storage, max_extent, flags);
+
+  for (unsigned it = 0; it < iters; ++it) {
+    unsigned idx = rng() % n;
+    unsigned cnt = rng() % 300;
+    if (idx + cnt > n)
+      cnt = n - idx;
+
+    switch (rng() % 4) {
+    case 0: bitmap_set(&b, idx); ref[idx] = 1; break;
+    case 1: bitmap_clear(&b, idx); ref[idx] = 0; break;
+    case 2: bitmap_set_range(&b, idx, cnt); memset(&ref[idx], 1, cnt); break;
+    case 3: bitmap_clear_range(&b, idx, cnt); memset(&ref[idx], 0, cnt); break;
+    }
+
+    unsigned from = rng() % n;
+    check(bitmap_isset(&b, idx) == ref[idx], "isset(%u)", idx);
+    check(bitmap_first_set(&b) == ref_next(ref, n, 0, 1),
+          "first_set, extent %ld", (long)max_extent);
+    check(bitmap_first_clear(&b) == ref_next(ref, n, 0, 0),
+          "first_clear, extent %ld", (long)max_extent);
+    check(bitmap_next_set(&b, from) == ref_next(ref, n, from, 1),
+          "next_set(%u), extent %ld", from, (long)max_extent);
+    check(bitmap_next_clear(&b, from) == ref_next(ref, n, from, 0),
+          "next_clear(%u), extent %ld", from, (long)max_extent);
+  }
+
+  free(storage);
+  free(ref);
+}
+
+static void test_bitmap() {
+  static const int64_t sizes[] = {0, 1, 31, 32, 33, 1023, 1024, 1025, 40000,
+                                  1 << 20};
+  for (unsigned i = 0; i < sizeof(sizes)/sizeof(sizes[0]); ++i) {
+    unsigned iters = sizes[i] > 10000 ? 2000 : 20000;
+    test_bitmap_size(sizes[i], 0, iters);
+    test_bitmap_size(sizes[i], BITMAP_TRACK_CLEAR, iters);
+  }
+}
+
+/*******************************************************************************
+ * Buddy allocator
+ ******************************************************************************/
+
+#define MAX_LIVE 4096
+
+/* The reference model is one byte per page: nonzero if the page is
+   allocated. */
+static void test_buddy_region(uint64_t start, uint64_t extent,
+                              unsigned max_shift, unsigned iters) {
+  range_t r = {start, extent};
+  uint8_t *storage = malloc(buddy_calc_overhead(r));
+  uint64_t npages = extent / PAGE_SZ + 1;
+  char *ref = calloc(npages, 1);
+  static uint64_t addrs[MAX_LIVE], szs[MAX_LIVE];
+  unsigned n = 0;
+
+  buddy_t bd;
+  buddy_init(&bd, storage, r, /*start_freed=*/1);
+
+  for (unsigned it = 0; it < iters; ++it) {
+    if (n < MAX_LIVE && (n == 0 || rng() % 2)) {
+      uint64_t sz = PAGE_SZ << (rng() % (max_shift + 1));
+      uint64_t a = buddy_alloc(&bd, sz);
+      if (a == ~0ULL)
+        continue;
+
+      check((a & (sz - 1)) == 0, "alloc %#llx not aligned to %#llx",
+            (unsigned long long)a, (unsigned long long)sz);
+      check(a >= start && a + sz <= start + extent,
+            "alloc %#llx outside region", (unsigned long long)a);
+      for (uint64_t p = (a - start) / PAGE_SZ; p < (a - start + sz) / PAGE_SZ; ++p) {
+        check(ref[p] == 0, "alloc %#llx overlaps live block",
+              (unsigned long long)a);
+        ref[p] = 1;
+      }
+      addrs[n] = a;
+      szs[n++] = sz;
+    } else {
+      unsigned k = rng() % n;
+      buddy_free(&bd, addrs[k], szs[k]);
+      memset(&ref[(addrs[k] - start) / PAGE_SZ], 0, szs[k] / PAGE_SZ);
+      addrs[k] = addrs[--n];
+      szs[k] = szs[n];
+    }
+  }
+
+  while (n > 0) {
+    --n;
+    buddy_free(&bd, addrs[n], szs[n]);
+  }
+
+  /* Everything should have coalesced back, so every aligned page in the
+     region must be allocatable again. */
+  uint64_t first = (start + PAGE_SZ - 1) & ~(PAGE_SZ - 1);
+  uint64_t expected = ((start + extent) & ~(PAGE_SZ - 1)) - first;
+  uint64_t total = 0;
+  while (buddy_alloc(&bd, PAGE_SZ) != ~0ULL)
+    total += PAGE_SZ;
+  check(total == expected, "region %#llx+%#llx: reclaimed %#llx of %#llx",
+        (unsigned long long)start, (unsigned long long)extent,
+        (unsigned long long)total, (unsigned long long)expected);
+
+  free(storage);
+  free(ref);
+}
+
+/* buddy_alloc_batch, buddy_alloc_aligned and buddy_reserve. */
+static void test_buddy_extras() {
+  range_t r = {0x123000, 0x1000000};
+  uint8_t *storage = malloc(buddy_calc_overhead(r));
+  uint64_t npages = r.extent / PAGE_SZ;
+  char *ref = calloc(npages, 1);
+  uint64_t out[64];
+  buddy_t bd;
+  buddy_init(&bd, storage, r, /*start_freed=*/1);
+
+  size_t got = buddy_alloc_batch(&bd, 2 * PAGE_SZ, 64, out);
+  check(got == 64, "batch returned %zu of 64", got);
+  for (size_t i = 0; i < got; ++i) {
+    for (uint64_t p = (out[i] - r.start) / PAGE_SZ;
+         p < (out[i] - r.start) / PAGE_SZ + 2; ++p) {
+      check(ref[p] == 0, "batch %#llx overlaps", (unsigned long long)out[i]);
+      ref[p] = 1;
+    }
+  }
+
+  uint64_t a = buddy_alloc_aligned(&bd, PAGE_SZ, 0x100000);
+  check(a != ~0ULL && (a & 0xFFFFF) == 0, "aligned alloc %#llx",
+        (unsigned long long)a);
+  check(ref[(a - r.start) / PAGE_SZ] == 0, "aligned alloc overlaps");
+  ref[(a - r.start) / PAGE_SZ] = 1;
+
+  /* Reserve a range the allocations above left free, then check a second
+     reserve of it fails. */
+  range_t res;
+  res.start = r.start + r.extent / 2;
+  res.extent = 0x5000;
+  check(buddy_reserve(&bd, res) == 0, "reserve of free range failed");
+  check(buddy_reserve(&bd, res) == -1, "double reserve succeeded");
+  memset(&ref[(res.start - r.start) / PAGE_SZ], 1, res.extent / PAGE_SZ);
+
+  /* Nothing handed out afterwards may overlap any of the above. */
+  while ((a = buddy_alloc(&bd, PAGE_SZ)) != ~0ULL) {
+    check(ref[(a - r.start) / PAGE_SZ] == 0, "alloc %#llx overlaps",
+          (unsigned long long)a);
+    ref[(a - r.start) / PAGE_SZ] = 1;
+  }
+  for (uint64_t p = 0; p < npages; ++p)
+    check(ref[p] == 1, "page %#llx was never handed out",
+          (unsigned long long)(r.start + p * PAGE_SZ));
+
+  /* Give everything back and check it all coalesces. */
+  buddy_free_range(&bd, r);
+  a = buddy_alloc(&bd, 0x800000);
+  check(a != ~0ULL, "region did not coalesce after free_range");
+
+  free(storage);
+  free(ref);
+}
+
+static void test_buddy() {
+  test_buddy_region(0x100000, 0x4000000 - 0x100000, 8, 100000);
+  test_buddy_region(0x123456, 0x3456789, 10, 100000);
+  test_buddy_region(0xD0000000, 0x2E800000, 14, 50000);
+  test_buddy_region(0x100000000ULL, 0x180000000ULL, 18, 50000);
+  test_buddy_extras();
+}
+
+/*******************************************************************************
+ * Ring buffer
+ ******************************************************************************/
+
+static void test_ringbuf() {
+  char storage[64], in[100], out[100];
+  char_ringbuf_t rb = make_char_ringbuf(storage, sizeof(storage));
+  unsigned char wseq = 0, rseq = 0;
+  unsigned used = 0, dropped = 0;
+
+  for (unsigned it = 0; it < 100000; ++it) {
+    if (rng() % 2) {
+      /* Sometimes write more than fits, to exercise overflow accounting. */
+      int len = rng() % sizeof(in);
+      int fits = (len < (int)(sizeof(storage) - used)) ?
+        len : (int)(sizeof(storage) - used);
+      for (int i = 0; i < len; ++i)
+        in[i] = wseq + i;
+      int put = char_ringbuf_write(&rb, in, len);
+      check(put == fits, "wrote %d of %d, %u used", put, len, used);
+      wseq += put;
+      used += put;
+      dropped += len - put;
+      check(rb.rb.overflows == dropped, "overflows %u, expected %u",
+            rb.rb.overflows, dropped);
+    } else {
+      int len = rng() % sizeof(out);
+      int got = char_ringbuf_read(&rb, out, len);
+      check(got == ((unsigned)len < used ? len : (int)used),
+            "read %d of %d, %u used", got, len, used);
+      for (int i = 0; i < got; ++i)
+        check((unsigned char)out[i] == rseq++, "data mismatch");
+      used -= got;
+    }
+    check(char_ringbuf_used(&rb) == used, "used %u, expected %u",
+          char_ringbuf_used(&rb), used);
+  }
+
+  /* Wider elements take the same paths, scaled by the element size. */
+  static uint64_t wide[8];
+  ringbuf_t w = make_ringbuf(wide, sizeof(uint64_t), 8);
+  uint64_t win[6] = {1, 2, 3, 4, 5, 6}, wout[8];
+  check(ringbuf_write(&w, win, 6) == 6, "wide write");
+  check(ringbuf_read(&w, wout, 4) == 4 && wout[3] == 4, "wide read");
+  check(ringbuf_write(&w, win, 6) == 6, "wide wrapping write");
+  check(ringbuf_read(&w, wout, 8) == 8 && wout[1] == 6 && wout[7] == 6,
+        "wide wrapping read");
+}
+
+/*******************************************************************************
+ * Benchmarks
+ ******************************************************************************/
+
+static void bench_buddy(uint64_t extent) {
+  range_t r = {0x100000, extent};
+  uint8_t *storage = malloc(buddy_calc_overhead(r));
+  unsigned n = extent / PAGE_SZ;
+  if (n > 1 << 20)
+    n = 1 << 20;
+  uint64_t *addrs = malloc(n * sizeof(uint64_t));
+  buddy_t bd;
+
+  /* buddy_init plus buddy_free_range over the whole region, as done at
+     boot. */
+  double t = now_ns();
+  unsigned reps = 0;
+  do {
+    buddy_init(&bd, storage, r, /*start_freed=*/0);
+    buddy_free_range(&bd, r);
+    ++reps;
+  } while (now_ns() - t < 2e8);
+  double free_range = (now_ns() - t) / reps;
+
+  t = now_ns();
+  for (unsigned i = 0; i < n; ++i)
+    addrs[i] = buddy_alloc(&bd, PAGE_SZ);
+  double alloc = (now_ns() - t) / n;
+
+  /* Free in a shuffled order so coalescing is exercised realistically. */
+  for (unsigned i = n - 1; i > 0; --i) {
+    unsigned j = rng() % (i + 1);
+    uint64_t tmp = addrs[i]; addrs[i] = addrs[j]; addrs[j] = tmp;
+  }
+  t = now_ns();
+  for (unsigned i = 0; i < n; ++i)
+    buddy_free(&bd, addrs[i], PAGE_SZ);
+  double dealloc = (now_ns() - t) / n;
+
+  printf("  buddy %6lluMB: alloc %8.1f ns/op  free %8.1f ns/op  "
+         "init+free_range %10.1f ns  metadata %6zuKB\n",
+         (unsigned long long)(extent >> 20), alloc, dealloc, free_range,
+         buddy_calc_overhead(r) >> 10);
+
+  free(storage);
+  free(addrs);
+}
+
+static void bench_bitmap(int64_t max_extent) {
+  uint8_t *storage = malloc(bitmap_calc_overhead(max_extent, 0));
+  bitmap_t b;
+  bitmap_init(&b, storage, max_extent, 0);
+
+  /* Worst case for a linear scan: only the last bit is set. */
+  bitmap_set(&b, max_extent);
+
+  unsigned reps = 1000000;
+  volatile int64_t sink = 0;
+  double t = now_ns();
+  for (unsigned i = 0; i < reps; ++i)
+    sink += bitmap_first_set(&b);
+  double first_set = (now_ns() - t) / reps;
+
+  printf("  bitmap %8lld bits: first_set %8.1f ns/op\n",
+         (long long)max_extent + 1, first_set);
+
+  free(storage);
+}
+
+static void bench() {
+  static const uint64_t regions[] = {16ULL << 20, 256ULL << 20, 4ULL << 30};
+  for (unsigned i = 0; i < sizeof(regions)/sizeof(regions[0]); ++i)
+    bench_buddy(regions[i]);
+
+  static const int64_t bitmaps[] = {(1 << 12) - 1, (1 << 16) - 1,
+                                    (1 << 20) - 1, (1 << 24) - 1};
+  for (unsigned i = 0; i < sizeof(bitmaps)/sizeof(bitmaps[0]); ++i)
+    bench_bitmap(bitmaps[i]);
+}
+
+/******************************************************************************/
+
+static void run(const char *name, void (*fn)()) {
+  int before = failures;
+  fn();
+  printf("%s %s\n", (failures == before) ? "PASS" : "FAIL", name);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s test|bench\n", argv[0]);
+    return 2;
+  }
+
+  if (!strcmp(argv[1], "test")) {
+    run("bitmap", &test_bitmap);
+    run("buddy", &test_buddy);
+    run("ringbuf", &test_ringbuf);
+    return failures ? 1 : 0;
+  }
+
+  if (!strcmp(argv[1], "bench")) {
+    bench();
+    return 0;
+  }
+
+  fprintf(stderr, "Unknown command '%s'\n", argv[1]);
+  return 2;
+}
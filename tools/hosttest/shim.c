@@ -0,0 +1,15 @@
+/* The kernel ADTs call into the HAL for panic() and assert_fail(). When
+   built for the host, those just report and abort. */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+void panic(const char *message) {
+  fprintf(stderr, "*** System panic!: %s\n", message);
+  abort();
+}
+
+void assert_fail(const char *cond, const char *file, int line) {
+  fprintf(stderr, "*** Assertion failed: %s\n***   @ %s:%d\n", cond, file, line);
+  abort();
+}